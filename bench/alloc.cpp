@@ -0,0 +1,131 @@
+// Allocation microbenchmark: ALLOC_TASKS tasks between them allocate `size'
+// objects in lists, each task dropping its list once it holds
+// ALLOC_LIST_BYTES. Variants pick the object sizes:
+//
+//   small   16 bytes
+//   mixed   16 to 256 bytes
+//   large   256 to 8K bytes
+//
+// Built three ways: against gc.cpp (alloc), against gc-dummy.cpp
+// (alloc-dummy), and with BENCH_MALLOC defined to use malloc() and free()
+// instead of the GC (alloc-malloc).
+
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+// How much each list gets before we drop it; each task keeps about half that
+// live at any time.
+#define ALLOC_LIST_BYTES (4 * 1024 * 1024)
+
+// How many tasks share the work.
+#define ALLOC_TASKS 64
+
+struct Obj {
+    Obj *next;
+    size_t size;
+};
+
+struct Sizes {
+    const char *name;
+    size_t min, max;
+};
+
+static const Sizes sizes[] = {
+    { "small", 16, 16 },
+    { "mixed", 16, 256 },
+    { "large", 256, 8192 },
+};
+
+#ifdef BENCH_MALLOC
+static void free_list(Obj *list) {
+    while (list) {
+        Obj *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+#endif
+
+struct Part {
+    const Sizes *sizes;
+    long n;
+    uint64_t seed;
+};
+
+static rt::ptr_t alloc_part(rt::Context *cx, void *data) {
+    Part *p = (Part*) data;
+    const Sizes *s = p->sizes;
+    rt::Scope scope(cx, 1);
+    rt::Root list(scope);
+    uint64_t x = p->seed;
+    long length = 0;
+    size_t bytes = 0;
+    for (long i = 0; i < p->n; ++i) {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t size = s->min + x % (s->max - s->min + 1);
+
+#ifdef BENCH_MALLOC
+        Obj *obj = (Obj*) malloc(size);
+        if (!obj) util::die("out of memory");
+#else
+        Obj *obj = (Obj*) cx->alloc(size, gc::layout_prefix(1));
+#endif
+        obj->next = (Obj*) list.get();
+        obj->size = size;
+        list.set(obj);
+
+        ++length;
+        if ((bytes += size) >= ALLOC_LIST_BYTES) {
+#ifdef BENCH_MALLOC
+            free_list((Obj*) list.get());
+#endif
+            list.set(NULL);
+            length = 0;
+            bytes = 0;
+        }
+    }
+
+    long count = 0;
+    for (Obj *obj = (Obj*) list.get(); obj; obj = obj->next) {
+        if (obj->size < s->min || obj->size > s->max)
+            util::die("alloc: object corrupted");
+        ++count;
+    }
+    if (count != length)
+        util::die("alloc: list has %ld objects, not %ld", count, length);
+#ifdef BENCH_MALLOC
+    free_list((Obj*) list.get());
+#endif
+    return NULL;
+}
+
+static uint64_t run(rt::Context *cx, long n, const char *variant) {
+    const Sizes *s = NULL;
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+        if (!strcmp(variant, sizes[i].name))
+            s = &sizes[i];
+    }
+    if (!s)
+        util::die("alloc: no variant '%s'", variant);
+
+    Part parts[ALLOC_TASKS];
+    rt::TaskFn fns[ALLOC_TASKS];
+    for (size_t i = 0; i < ALLOC_TASKS; ++i) {
+        parts[i].sizes = s;
+        parts[i].n = n / ALLOC_TASKS + ((long) i < n % ALLOC_TASKS);
+        parts[i].seed = 88172645463325252ULL * (i + 1);
+        fns[i] = rt::TaskFn(alloc_part, &parts[i]);
+    }
+
+    rt::Scope scope(cx, ALLOC_TASKS);
+    RootArray rets(scope, ALLOC_TASKS);
+    cx->forkN(ALLOC_TASKS, &rets[0], fns);
+    return n;
+}
+
+const Benchmark benchmark = { "allocs", 10 * 1000 * 1000, "mixed", run };
@@ -0,0 +1,67 @@
+// Benchmark driver; see bench.hpp.
+
+#include "bench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <sys/resource.h>
+}
+
+using namespace util;
+
+static long max_rss_kb() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru)) {
+        perror("getrusage");
+        die();
+    }
+    return ru.ru_maxrss;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 3)
+        die("usage: %s [size [variant]]", argv[0]);
+
+    const char *name = strrchr(argv[0], '/');
+    name = name ? name + 1 : argv[0];
+
+    long size = benchmark.default_size;
+    if (argc > 1 && *argv[1]) {
+        char *end;
+        size = strtol(argv[1], &end, 10);
+        if (*end || size < 0)
+            die("bad size: '%s'", argv[1]);
+    }
+    const char *variant = argc > 2 ? argv[2] : benchmark.default_variant;
+
+    rt::Context *cx = rt::Context::init();
+    size_t workers = MAX(env_size("PML_WORKERS", num_cpus()), 1);
+
+    uint64_t start = now_ns();
+    uint64_t units = benchmark.run(cx, size, variant);
+    double secs = (now_ns() - start) / 1e9;
+
+    rt::Context::finish(cx);
+
+    printf("%s", name);
+    if (variant)
+        printf(" variant=%s", variant);
+    printf(" workers=%zu size=%ld time=%.3f throughput=%.3g %s/s maxrss=%ld\n",
+           workers, size, secs, units / secs, benchmark.unit, max_rss_kb());
+    return 0;
+}
+
+namespace gc {
+namespace client {
+
+void find_ptrs(CycleContext *cx, ptr_t object) {
+    die("benchmark object without a layout");
+    (void) cx;
+    (void) object;
+}
+
+} // namespace client
+} // namespace gc
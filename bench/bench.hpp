@@ -0,0 +1,67 @@
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "../rt.hpp"
+#include "../util.hpp"
+
+/* ---------- Benchmarks ----------
+ *
+ * Each benchmark program defines `benchmark'. bench.cpp supplies main(),
+ * which runs it once and prints a line like
+ *
+ *   fib workers=4 size=32 time=1.234 throughput=5.6e+06 calls/s maxrss=2048
+ *
+ * with the time in seconds and the peak RSS in kilobytes. Usage is
+ * `prog [size [variant]]', where an empty size means the default; the number
+ * of workers comes from $PML_WORKERS as usual. bench/run.sh runs the whole
+ * suite for a range of worker counts.
+ *
+ * Every object the benchmarks allocate has a layout (see gc::layout_t), so
+ * gc::client::find_ptrs() is never called.
+ */
+struct Benchmark {
+    const char *unit;           // what run() counts
+    long default_size;
+    const char *default_variant; // NULL if there are no variants
+    // Runs the benchmark on a problem of size `size', checks the answer and
+    // returns how many units of work it did. Dies if the answer is wrong.
+    uint64_t (*run)(rt::Context *cx, long size, const char *variant);
+};
+
+extern const Benchmark benchmark;
+
+// Boxed integers, for task results.
+inline rt::ptr_t box(rt::Context *cx, long v) {
+    long *p = (long*) cx->alloc(sizeof(long), gc::LAYOUT_NOPTRS);
+    *p = v;
+    return p;
+}
+
+inline long unbox(rt::ptr_t p) { return *(long*) p; }
+
+// `n' roots in a row, for forkN().
+struct RootArray {
+    rt::Root *roots;
+    size_t n;
+
+    RootArray(const rt::Scope &scope, size_t count)
+        : roots((rt::Root*) util::smalloc(count * sizeof(rt::Root))),
+          n(count)
+    {
+        for (size_t i = 0; i < n; ++i)
+            new (&roots[i]) rt::Root(scope);
+    }
+
+    ~RootArray() { util::sfree(n * sizeof(rt::Root), roots); }
+
+    rt::Root &operator[](size_t i) { return roots[i]; }
+
+  private:
+    NO_COPY(RootArray);
+};
+
+#endif // BENCH_HPP_
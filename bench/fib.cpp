@@ -0,0 +1,42 @@
+// Naive doubly-recursive Fibonacci: nothing but forks and tiny results.
+
+#include "bench.hpp"
+
+// Below this, plain recursion.
+#define FIB_CUTOFF 20
+
+static long fib_seq(long n) {
+    return n < 2 ? n : fib_seq(n - 1) + fib_seq(n - 2);
+}
+
+static rt::ptr_t fib(rt::Context *cx, void *data) {
+    long n = (long)(intptr_t) data;
+    if (n < FIB_CUTOFF)
+        return box(cx, fib_seq(n));
+
+    rt::Scope scope(cx, 2);
+    rt::Root a(scope), b(scope);
+    cx->fork(&a, &b,
+             rt::TaskFn(fib, (void*)(intptr_t)(n - 1)),
+             rt::TaskFn(fib, (void*)(intptr_t)(n - 2)));
+    return box(cx, unbox(a.get()) + unbox(b.get()));
+}
+
+static uint64_t run(rt::Context *cx, long n, const char *variant) {
+    (void) variant;
+    rt::Scope scope(cx, 1);
+    rt::Root result(scope, fib(cx, (void*)(intptr_t) n));
+
+    long f0 = 0, f1 = 1;
+    for (long i = 0; i < n; ++i) {
+        long f2 = f0 + f1;
+        f0 = f1;
+        f1 = f2;
+    }
+    if (unbox(result.get()) != f0)
+        util::die("fib(%ld) = %ld, not %ld", n, unbox(result.get()), f0);
+    // fib(n) makes 2 fib(n+1) - 1 calls.
+    return 2 * f1 - 1;
+}
+
+const Benchmark benchmark = { "calls", 42, NULL, run };
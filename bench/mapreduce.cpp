@@ -0,0 +1,60 @@
+// Maps a function over an array in place and sums the result, one forkN()
+// task per block of the array.
+
+#include "bench.hpp"
+
+// Elements per task.
+#define MAPREDUCE_BLOCK (64 * 1024)
+
+struct Block {
+    long *a;
+    size_t lo, hi;
+};
+
+static rt::ptr_t map_reduce(rt::Context *cx, void *data) {
+    Block *b = (Block*) data;
+    long sum = 0;
+    for (size_t i = b->lo; i < b->hi; ++i) {
+        b->a[i] = 3 * b->a[i] + 1;
+        sum += b->a[i];
+    }
+    return box(cx, sum);
+}
+
+static uint64_t run(rt::Context *cx, long n, const char *variant) {
+    (void) variant;
+    size_t nblocks = (n + MAPREDUCE_BLOCK - 1) / MAPREDUCE_BLOCK;
+    rt::Scope scope(cx, nblocks + 1);
+    rt::Root array(scope);
+    cx->alloc(&array, n * sizeof(long), gc::LAYOUT_NOPTRS);
+    long *a = (long*) array.get();
+    for (long i = 0; i < n; ++i)
+        a[i] = i;
+
+    Block *blocks = (Block*) util::smalloc(nblocks * sizeof(Block));
+    rt::TaskFn *fns = (rt::TaskFn*) util::smalloc(nblocks * sizeof(rt::TaskFn));
+    for (size_t i = 0; i < nblocks; ++i) {
+        blocks[i].a = a;
+        blocks[i].lo = i * MAPREDUCE_BLOCK;
+        blocks[i].hi = MIN((i + 1) * MAPREDUCE_BLOCK, (size_t) n);
+        fns[i] = rt::TaskFn(map_reduce, &blocks[i]);
+    }
+
+    long sum = 0;
+    {
+        RootArray rets(scope, nblocks);
+        cx->forkN(nblocks, &rets[0], fns);
+        for (size_t i = 0; i < nblocks; ++i)
+            sum += unbox(rets[i].get());
+    }
+    util::sfree(nblocks * sizeof(Block), blocks);
+    util::sfree(nblocks * sizeof(rt::TaskFn), fns);
+
+    // sum of 3i + 1 for i < n
+    long expect = 3 * (n * (n - 1) / 2) + n;
+    if (sum != expect)
+        util::die("mapreduce: sum is %ld, not %ld", sum, expect);
+    return n;
+}
+
+const Benchmark benchmark = { "elements", 64 * 1024 * 1024, NULL, run };
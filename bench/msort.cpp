@@ -0,0 +1,71 @@
+// Parallel mergesort of an array of longs in the GC heap. The halves are
+// sorted in parallel and merged sequentially.
+
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// Ranges this short are sorted sequentially.
+#define MSORT_CUTOFF 8192
+
+struct Range {
+    long *a, *tmp;
+    size_t lo, hi;
+};
+
+static rt::ptr_t msort(rt::Context *cx, void *data) {
+    Range *r = (Range*) data;
+    if (r->hi - r->lo <= MSORT_CUTOFF) {
+        std::sort(r->a + r->lo, r->a + r->hi);
+        return NULL;
+    }
+
+    size_t mid = r->lo + (r->hi - r->lo) / 2;
+    Range left = { r->a, r->tmp, r->lo, mid };
+    Range right = { r->a, r->tmp, mid, r->hi };
+    {
+        rt::Scope scope(cx, 2);
+        rt::Root a(scope), b(scope);
+        cx->fork(&a, &b, rt::TaskFn(msort, &left), rt::TaskFn(msort, &right));
+    }
+
+    std::merge(r->a + r->lo, r->a + mid, r->a + mid, r->a + r->hi,
+               r->tmp + r->lo);
+    memcpy(r->a + r->lo, r->tmp + r->lo, (r->hi - r->lo) * sizeof(long));
+    return NULL;
+}
+
+static uint64_t run(rt::Context *cx, long n, const char *variant) {
+    (void) variant;
+    rt::Scope scope(cx, 2);
+    rt::Root a(scope), tmp(scope);
+    cx->alloc(&a, n * sizeof(long), gc::LAYOUT_NOPTRS);
+    long *array = (long*) a.get();
+    uint64_t x = 88172645463325252ULL, sum = 0;
+    for (long i = 0; i < n; ++i) {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        array[i] = (long)(x >> 1);
+        sum += array[i];
+    }
+    cx->alloc(&tmp, n * sizeof(long), gc::LAYOUT_NOPTRS);
+    // Allocating may have moved the array.
+    array = (long*) a.get();
+
+    Range r = { array, (long*) tmp.get(), 0, (size_t) n };
+    msort(cx, &r);
+
+    for (long i = 0; i < n; ++i) {
+        if (i && array[i - 1] > array[i])
+            util::die("msort: out of order at %ld", i);
+        sum -= array[i];
+    }
+    if (sum)
+        util::die("msort: elements changed");
+    return n;
+}
+
+const Benchmark benchmark = { "elements", 4 * 1024 * 1024, NULL, run };
@@ -0,0 +1,79 @@
+// Counts the solutions to the n-queens problem, forking over the columns of
+// the first few rows.
+
+#include "bench.hpp"
+
+// Rows from this one down are searched sequentially.
+#define NQUEENS_CUTOFF 3
+
+struct Board {
+    int n, row;
+    // Columns and diagonals under attack, as bitmasks.
+    uint32_t cols, left, right;
+};
+
+static long count_seq(int n, int row, uint32_t cols, uint32_t left,
+                      uint32_t right)
+{
+    if (row == n) return 1;
+    uint32_t all = (1u << n) - 1;
+    uint32_t free = all & ~(cols | left | right);
+    long count = 0;
+    while (free) {
+        uint32_t bit = free & -free;
+        free &= free - 1;
+        count += count_seq(n, row + 1, cols | bit, ((left | bit) << 1) & all,
+                           (right | bit) >> 1);
+    }
+    return count;
+}
+
+static rt::ptr_t count(rt::Context *cx, void *data) {
+    Board *b = (Board*) data;
+    if (b->row >= NQUEENS_CUTOFF || b->row == b->n)
+        return box(cx, count_seq(b->n, b->row, b->cols, b->left, b->right));
+
+    uint32_t all = (1u << b->n) - 1;
+    uint32_t free = all & ~(b->cols | b->left | b->right);
+    Board next[32];
+    rt::TaskFn fns[32];
+    size_t m = 0;
+    for (; free; free &= free - 1, ++m) {
+        uint32_t bit = free & -free;
+        next[m].n = b->n;
+        next[m].row = b->row + 1;
+        next[m].cols = b->cols | bit;
+        next[m].left = ((b->left | bit) << 1) & all;
+        next[m].right = (b->right | bit) >> 1;
+        fns[m] = rt::TaskFn(count, &next[m]);
+    }
+    if (!m) return box(cx, 0);
+
+    rt::Scope scope(cx, m);
+    RootArray rets(scope, m);
+    cx->forkN(m, &rets[0], fns);
+    long total = 0;
+    for (size_t i = 0; i < m; ++i)
+        total += unbox(rets[i].get());
+    return box(cx, total);
+}
+
+static uint64_t run(rt::Context *cx, long n, const char *variant) {
+    (void) variant;
+    static const long solutions[] = {
+        1, 1, 0, 0, 2, 10, 4, 40, 92, 352, 724, 2680, 14200, 73712, 365596,
+        2279184, 14772512,
+    };
+    if (n < 1 || n >= (long)(sizeof solutions / sizeof solutions[0]))
+        util::die("nqueens: size must be from 1 to 16");
+
+    Board b = { (int) n, 0, 0, 0, 0 };
+    rt::Scope scope(cx, 1);
+    rt::Root result(scope, count(cx, &b));
+    if (unbox(result.get()) != solutions[n])
+        util::die("nqueens(%ld) = %ld, not %ld", n, unbox(result.get()),
+                  solutions[n]);
+    return solutions[n];
+}
+
+const Benchmark benchmark = { "solutions", 14, NULL, run };
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Runs the benchmark suite with 1, 2, 4, ... workers, up to $1 (by default,
+# the number of CPUs), printing one line per run. A benchmark's problem size
+# can be set in $BENCH_SIZE_<name>, e.g. BENCH_SIZE_fib=30.
+set -e
+
+dir=$(dirname "$0")
+max=${1:-$(getconf _NPROCESSORS_ONLN)}
+
+workers=""
+w=1
+while [ "$w" -lt "$max" ]; do
+    workers="$workers $w"
+    w=$((w * 2))
+done
+workers="$workers $max"
+
+run() {
+    name=$1
+    variant=$2
+    eval "size=\${BENCH_SIZE_$(echo "$name" | tr - _):-$3}"
+    for w in $workers; do
+        # An empty size means the default.
+        PML_WORKERS=$w "$dir/$name" "$size" $variant
+    done
+}
+
+for b in fib nqueens msort tree mapreduce; do
+    run $b
+    # The serial scheduler has one worker however many we ask for.
+    workers=1 run $b-serial "" "$(eval "echo \${BENCH_SIZE_$b:-}")"
+done
+# gc-dummy.cpp never frees anything, so keep the total allocated in bounds.
+for variant in "small 20000000" "mixed 10000000" "large 250000"; do
+    set -- $variant
+    for b in alloc alloc-dummy alloc-malloc; do
+        run $b $1 $2
+    done
+done
@@ -0,0 +1,83 @@
+// Builds a complete binary tree in parallel, each subtree in the heap of the
+// task that built it, then sums it in parallel.
+
+#include "bench.hpp"
+
+// Subtrees this shallow are built and summed sequentially.
+#define TREE_CUTOFF 12
+
+struct Node {
+    Node *left, *right;
+    long value;
+};
+
+static const gc::layout_t NODE_LAYOUT = gc::layout_prefix(2);
+
+static rt::ptr_t build_seq(rt::Context *cx, long depth) {
+    rt::Scope scope(cx, 2);
+    rt::Root left(scope), right(scope);
+    if (depth > 0) {
+        left.set(build_seq(cx, depth - 1));
+        right.set(build_seq(cx, depth - 1));
+    }
+    Node *node = (Node*) cx->alloc(sizeof(Node), NODE_LAYOUT);
+    node->left = (Node*) left.get();
+    node->right = (Node*) right.get();
+    node->value = 1;
+    return node;
+}
+
+static rt::ptr_t build(rt::Context *cx, void *data) {
+    long depth = (long)(intptr_t) data;
+    if (depth <= TREE_CUTOFF)
+        return build_seq(cx, depth);
+
+    rt::Scope scope(cx, 2);
+    rt::Root left(scope), right(scope);
+    rt::TaskFn fn(build, (void*)(intptr_t)(depth - 1));
+    cx->fork(&left, &right, fn, fn);
+    Node *node = (Node*) cx->alloc(sizeof(Node), NODE_LAYOUT);
+    node->left = (Node*) left.get();
+    node->right = (Node*) right.get();
+    node->value = 1;
+    return node;
+}
+
+static long sum_seq(Node *node) {
+    return node ? node->value + sum_seq(node->left) + sum_seq(node->right) : 0;
+}
+
+// The tree is kept alive by the root that holds it.
+struct Subtree {
+    Node *node;
+    long depth;
+};
+
+static rt::ptr_t sum(rt::Context *cx, void *data) {
+    Subtree *t = (Subtree*) data;
+    if (t->depth <= TREE_CUTOFF)
+        return box(cx, sum_seq(t->node));
+
+    Subtree left = { t->node->left, t->depth - 1 };
+    Subtree right = { t->node->right, t->depth - 1 };
+    rt::Scope scope(cx, 2);
+    rt::Root a(scope), b(scope);
+    cx->fork(&a, &b, rt::TaskFn(sum, &left), rt::TaskFn(sum, &right));
+    return box(cx, t->node->value + unbox(a.get()) + unbox(b.get()));
+}
+
+static uint64_t run(rt::Context *cx, long depth, const char *variant) {
+    (void) variant;
+    rt::Scope scope(cx, 2);
+    rt::Root tree(scope, build(cx, (void*)(intptr_t) depth));
+    // Forking pins the tree, so it stays put while we sum it.
+    Subtree t = { (Node*) tree.get(), depth };
+    rt::Root total(scope, sum(cx, &t));
+
+    long nodes = (2L << depth) - 1;
+    if (unbox(total.get()) != nodes)
+        util::die("tree: sum is %ld, not %ld", unbox(total.get()), nodes);
+    return 2 * nodes;
+}
+
+const Benchmark benchmark = { "nodes", 22, NULL, run };
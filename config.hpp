@@ -1,13 +1,117 @@
 #ifndef CONFIG_HPP_
 #define CONFIG_HPP_
 
+// Which GC and scheduler the runtime is built with. Everything linked together
+// must agree, so set these with -D for the whole build; the Makefile has a
+// target for each combination.
+#define GC_MARK_SWEEP 1         // gc.cpp
+#define GC_DUMMY 2              // gc-dummy.cpp
+#ifndef GC_BACKEND
+#define GC_BACKEND GC_MARK_SWEEP
+#endif
+
+#define SCHED_WORK_STEALING 1   // sched.cpp
+#define SCHED_SERIAL 2          // sched-serial.cpp
+#ifndef SCHED_BACKEND
+#define SCHED_BACKEND SCHED_WORK_STEALING
+#endif
+
 #define GC_NEWSPACE_RATIO 2.0
 
-// The minimum size of a "chunk" of memory used by the GC to allocate from.
-#define MIN_CHUNK_SIZE 4096
+// The size of a "chunk" of memory used by the GC to allocate from. Must be a
+// power of two, bigger than GC_LARGE_OBJECT_SIZE. Chunks are carved out of
+// slabs of GC_CHUNK_SLAB_SIZE bytes, mapped from the OS and never returned.
+#define GC_CHUNK_SIZE (128 * 1024)
+#define GC_CHUNK_SLAB_SIZE (2 * 1024 * 1024)
+
+// How many free chunks each thread keeps for itself before sharing them.
+#define GC_CHUNK_CACHE_SIZE 8
+
+// Shared free chunks are pooled by the CPU package (socket) whose memory they
+// were first touched from, with packages beyond this many sharing pools.
+#define GC_CHUNK_POOLS 4
+
+// Whether to ask for transparent huge pages to back chunk slabs.
+// Overridden by $PML_HUGE_PAGES.
+#define GC_HUGE_PAGES 0
+
+// Contexts bump-allocate small objects from regions of free space. When a
+// region runs out, we try to replace it with a free block at least this big.
+#define GC_MIN_REGION_SIZE 1024
+
+// Default size of each heap's copying nursery, in bytes; 0 disables it.
+// Overridden by $PML_NURSERY_SIZE.
+#define GC_NURSERY_SIZE 0
+
+// Objects at least this big (including their header) get pages of their own
+// in the large-object space, instead of coming from chunks.
+#define GC_LARGE_OBJECT_SIZE (64 * 1024)
+
+// Initial number of entries in the GC's mark stack, which grows as needed.
+#define GC_MARK_STACK_SIZE 256
+
+// Collections of heaps using at least this many bytes let idle scheduler
+// workers help with marking, if there are any other workers.
+#define GC_PARALLEL_MARK_THRESHOLD (4 * 1024 * 1024)
+
+// Number of grey objects marking threads hand each other at a time, and how
+// long a marking thread with no work spins before going to sleep.
+#define GC_MARK_PACKET_SIZE 256
+#define GC_MARK_SPIN_LIMIT 64
+
+// Idle workers collect a suspended heap once it has used this much of its
+// allowance (GC_NEWSPACE_RATIO times what was live after its last collection),
+// rather than leave the collection for after the join.
+#define GC_BACKGROUND_RATIO 1.5
 
 // I think this can actually be 4 on amd64 even though sizeof(void*) is 8? But
 // I should check that.
 #define MACHINE_ALIGNMENT (sizeof(void*))
 
+// Used to pad per-worker data so that workers don't share cache lines.
+#define CACHE_LINE_SIZE 64
+
+// Initial capacity of each scheduler worker's deque. Must be a power of two;
+// deques grow as needed.
+#define SCHED_DEQUE_INITIAL_SIZE 256
+
+// How many times an idle worker spins before it starts yielding its CPU, and
+// then how many times it yields before going to sleep.
+#define SCHED_SPIN_LIMIT 64
+#define SCHED_YIELD_LIMIT 32
+
+// Longest a sleeping worker goes without looking for work, in nanoseconds.
+// Wake-ups can be missed (see sched.cpp), so this bounds how long they delay
+// stealing.
+#define SCHED_PARK_TIMEOUT (10 * 1000 * 1000)
+
+// Whether to pin each scheduler worker to a CPU of its own. Overridden by
+// $PML_PIN_WORKERS; setting $PML_CPUS (see sched.cpp) pins them too.
+#define SCHED_PIN_WORKERS 0
+
+// Initial number of root slots in each task's shadow stack, which grows as
+// needed.
+#define RT_SHADOW_STACK_SIZE 64
+
+// Stack every task is guaranteed when it starts; if less is left, it runs on a
+// new stack chunk. Stolen tasks get a whole chunk.
+#define SCHED_STACK_RESERVE (1024 * 1024)
+
+// Size of worker threads' own stacks. They only run the steal loop on them;
+// stolen tasks run on stack chunks.
+#define SCHED_WORKER_STACK_SIZE (256 * 1024)
+
+// Size of each stack chunk, including its guard page; rounded up to a multiple
+// of the page size. Chunks are mapped lazily, so only the pages a task touches
+// take memory. Bigger chunks are made for tasks that ask for more. Overridden
+// by $PML_STACK_CHUNK_SIZE.
+#define STACK_CHUNK_SIZE (8 * 1024 * 1024)
+
+// How many unused stack chunks each thread keeps for reuse.
+#define STACK_CHUNK_CACHE_SIZE 4
+
+// Whether to keep runtime statistics (see stats.hpp). They cost a few loads
+// and stores on slow paths.
+#define STATS_ENABLED 1
+
 #endif // CONFIG_HPP_
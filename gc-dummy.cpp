@@ -1,43 +1,75 @@
-// Dummy GC implementation. Does no GC, just calls out to malloc.
+// Dummy GC implementation. Does no GC, just calls out to malloc (inline, in
+// gc.hpp). Nothing is ever freed.
 
 #include "gc.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
-#include <cstdlib>
 #include <cassert>
+#include <cstring>
 
-use util;
+#if GC_BACKEND != GC_DUMMY
+#error "gc-dummy.cpp is the dummy GC; build gc.cpp instead"
+#endif
 
 namespace gc {
 
-ptr_t alloc(Context *cx, size_t size, void *find_roots_data) {
-    (void) cx;
-    (void) find_roots_data;
-    void *p = malloc(size);
-    assert (p);
-    return p;
-}
+using namespace util;
 
-Context *init() { return NULL; }
-void finish(Context *cx) { (void) cx; }
+struct Context {
+    Context *parent;
+};
+
+Context *init() { return new Context(); }
+void finish(Context *cx) { delete cx; }
 
 Context *create(Context *parent) {
     assert (parent != NULL);
-    (void) parent;
-    return NULL;
+    Context *cx = new Context();
+    cx->parent = parent;
+    return cx;
 }
 
 Context *merge(
     Context *parent, void *parent_find_roots_data,
     Context *child, void *child_find_roots_data)
 {
-    (void) parent; (void) parent_find_roots_data;
-    (void) child; (void) child_find_roots_data;
-    return NULL;
+    (void) parent_find_roots_data;
+    (void) child_find_roots_data;
+    delete child;
+    stats::add(stats::gc_merges);
+    return parent;
+}
+
+void suspend(Context *cx, void *find_roots_data) {
+    (void) cx;
+    (void) find_roots_data;
+}
+
+void resume(Context *cx) {
+    (void) cx;
+}
+
+void set_nursery_size(Context *cx, size_t size) {
+    (void) cx;
+    (void) size;
+}
+
+void heap_stats(Context *cx, HeapStats *stats) {
+    (void) cx;
+    memset(stats, 0, sizeof *stats);
+}
+
+bool help() { return false; }
+
+// Never any work, so nobody to wake.
+void set_wake_hook(void (*fn)(void *data, size_t n), void *data) {
+    (void) fn;
+    (void) data;
 }
 
-void suspend(Context *heap) {
-    (void) heap;
+void set_num_helpers(size_t n) {
+    (void) n;
 }
 
 // should never get called
@@ -1,18 +1,26 @@
-// Dummy GC implementation. Does no GC, just calls out to malloc.
+// Mark-sweep GC with a separate heap per task.
 
 #include "gc.hpp"
 #include "config.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 extern "C" {
 #include <pthread.h>
 }
 
+#if GC_BACKEND != GC_MARK_SWEEP
+#error "gc.cpp is the mark-sweep GC; build gc-dummy.cpp instead"
+#endif
+
 namespace gc {
 
 using namespace util;
@@ -21,46 +29,61 @@ using namespace util;
  * ancestor heaps. They are monotonically increasing within the partial ordering
  * on heaps formed by memory visibility. That is to say, if heap A can see
  * objects in heap B, then heap A has a greater age than heap B.
+ *
+ * Concretely, a heap owns objects with ages from its base age (one more than
+ * its parent's age when it was created) up to its current age. Merging a child
+ * just raises the parent's age to cover the child's objects; the objects
+ * themselves are never relabelled, except that objects an ancestor's object
+ * points to carry AGE_REMEMBERED on top of their age (see write()).
  */
-typedef uint32_t age_t;
+typedef detail::age_t age_t;
+using detail::AGE_REMEMBERED;
 
 /* ---------- Chunks and blocks ---------- */
 extern "C" {
     typedef struct chunk chunk_t;
     typedef struct free_block free_block_t;
-    typedef struct used_block used_block_t;
 
-    // Header for a contiguous chunk of allocatable space
+    // Header for a contiguous chunk of allocatable space. Chunks of
+    // GC_CHUNK_SIZE come from the chunk pool and are aligned to their size;
+    // bigger ones are mapped individually.
     struct chunk {
         size_t size;
         chunk_t *next;
-    };
-
-    struct used_block {
-        // `size' includes space used by header
-        size_t size;            // low bits used for metadata
-        age_t age;
+        size_t pool;            // which shared pool it goes back to
     };
 
     struct free_block {
-        size_t size;            // ditto used_block
+        size_t size;            // ditto used_block_t
         free_block_t *next;     // next free block
     };
 }
 
+// Declared in gc.hpp so that the allocation fast path can fill it in.
+typedef detail::BlockHeader used_block_t;
+
 /* ---------- Manipulating block headers ---------- */
-#define BLOCK_SIZE_ALIGNMENT 4
-#define BLOCK_INFO_MASK      3
-#define BLOCK_USED_FLAG      1
+// Block sizes are kept machine-aligned so that every block, and hence every
+// object, is too.
+#define BLOCK_SIZE_ALIGNMENT detail::BLOCK_SIZE_ALIGNMENT
+#define BLOCK_INFO_MASK      7
+#define BLOCK_USED_FLAG      detail::BLOCK_USED_FLAG
 #define BLOCK_MARKED_FLAG    2
+#define BLOCK_LARGE_FLAG     4  // in the large-object space; never MARKED
 
 #define MACHINE_ALIGN(x) ALIGN_UP(MACHINE_ALIGNMENT, x)
 #define BLOCK_SIZE_ALIGN(x) ALIGN_UP(BLOCK_SIZE_ALIGNMENT, x)
-#define USED_BLOCK_HEADER_SIZE MACHINE_ALIGN(sizeof(used_block_t))
+#define USED_BLOCK_HEADER_SIZE detail::HEADER_SIZE
 #define CHUNK_HEADER_SIZE MACHINE_ALIGN(sizeof(chunk_t))
 
-#define MIN_BLOCK_SIZE BLOCK_SIZE_ALIGN(                                \
-        MAX(sizeof(free_block_t), USED_BLOCK_HEADER_SIZE + 2*sizeof(void*)))
+#define MIN_BLOCK_SIZE detail::MIN_BLOCK_SIZE
+static_assert(GC_CHUNK_SIZE >= CHUNK_HEADER_SIZE + GC_LARGE_OBJECT_SIZE,
+              "objects too small for the large-object space don't fit in "
+              "a chunk");
+static_assert(MIN_BLOCK_SIZE >= sizeof(free_block_t),
+              "free block header doesn't fit in MIN_BLOCK_SIZE");
+static_assert(BLOCK_SIZE_ALIGNMENT > BLOCK_INFO_MASK,
+              "block sizes don't leave room for metadata bits");
 
 static inline used_block_t *block_from_ptr(void *ptr) {
     assert (ALIGNED(MACHINE_ALIGNMENT, (uintptr_t) ptr));
@@ -71,10 +94,11 @@ static inline void *block_to_ptr(used_block_t *blk) {
     return (void*)(((char*)blk) + USED_BLOCK_HEADER_SIZE);
 }
 
-#define BLOCK_SIZE(blk) ((bool)((blk)->size & ~BLOCK_INFO_MASK))
+#define BLOCK_SIZE(blk) ((size_t)((blk)->size & ~BLOCK_INFO_MASK))
 #define BLOCK_USED(blk) ((bool)((blk)->size & BLOCK_USED_FLAG))
 #define BLOCK_FREE(blk) (!BLOCK_USED(blk))
 #define BLOCK_MARKED(blk) ((bool)((blk)->size & BLOCK_MARKED_FLAG))
+#define BLOCK_LARGE(blk) ((bool)((blk)->size & BLOCK_LARGE_FLAG))
 
 static inline free_block_t *block_make_free(used_block_t *blk) {
     assert (offsetof(used_block_t, size) == offsetof(free_block_t, size));
@@ -101,104 +125,722 @@ static inline void unmark_block(used_block_t *blk) {
 }
 
 
+/* ---------- Size classes ---------- */
+// Free blocks are kept in segregated lists by size. Each block size up to
+// SMALL_BLOCK_MAX has a list of its own; larger blocks go in power-of-two bins,
+// the first holding sizes in (SMALL_BLOCK_MAX, 2*SMALL_BLOCK_MAX].
+#define SMALL_BLOCK_MAX_LOG2 8
+#define SMALL_BLOCK_MAX      ((size_t)1 << SMALL_BLOCK_MAX_LOG2)
+
+#define NUM_SMALL_CLASSES (SMALL_BLOCK_MAX / BLOCK_SIZE_ALIGNMENT + 1)
+#define NUM_LARGE_CLASSES (8 * sizeof(size_t) - SMALL_BLOCK_MAX_LOG2)
+#define NUM_SIZE_CLASSES  (NUM_SMALL_CLASSES + NUM_LARGE_CLASSES)
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define CLASS_BITMAP_WORDS ((NUM_SIZE_CLASSES + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+static inline size_t floor_log2(size_t x) {
+    assert (x);
+    return 8 * sizeof(unsigned long) - 1 - __builtin_clzl(x);
+}
+
+static inline size_t size_class(size_t size) {
+    assert (ALIGNED(BLOCK_SIZE_ALIGNMENT, size));
+    if (size <= SMALL_BLOCK_MAX)
+        return size / BLOCK_SIZE_ALIGNMENT;
+    return NUM_SMALL_CLASSES + floor_log2(size - 1) - SMALL_BLOCK_MAX_LOG2;
+}
+
+
+/* ---------- Pointer stacks ---------- */
+struct PtrStack {
+    ptr_t *items;
+    size_t depth, capacity;
+
+    PtrStack() : items(NULL), depth(0), capacity(0) {}
+    ~PtrStack() {
+        if (items) sfree(capacity * sizeof(ptr_t), items);
+    }
+
+  private:
+    NO_COPY(PtrStack);
+};
+
+static void ptr_stack_grow(PtrStack *stack) {
+    size_t cap = MAX(2 * stack->capacity, (size_t) GC_MARK_STACK_SIZE);
+    ptr_t *items = (ptr_t*) smalloc(cap * sizeof(ptr_t));
+    if (stack->items) {
+        memcpy(items, stack->items, stack->depth * sizeof(ptr_t));
+        sfree(stack->capacity * sizeof(ptr_t), stack->items);
+    }
+    stack->items = items;
+    stack->capacity = cap;
+}
+
+static inline void ptr_stack_push(PtrStack *stack, ptr_t p) {
+    if (stack->depth == stack->capacity)
+        ptr_stack_grow(stack);
+    stack->items[stack->depth++] = p;
+}
+
+
+/* ---------- Large objects ---------- */
+/* Objects of GC_LARGE_OBJECT_SIZE or more live in the large-object space: each
+ * gets a mapping of its own, starting with a large_object_t and followed by an
+ * ordinary used block. They are never moved, split or put on free lists, and
+ * their mark bit is kept in the large_object_t, so that marking them doesn't
+ * dirty the object's own pages. A dead one is unmapped straight away.
+ */
+struct large_object_t {
+    large_object_t *next;       // in its heap's list
+    size_t map_size;
+    std::atomic<bool> marked;
+};
+
+#define LARGE_OBJECT_HEADER_SIZE MACHINE_ALIGN(sizeof(large_object_t))
+
+static inline used_block_t *large_object_block(large_object_t *lo) {
+    return (used_block_t*)(((char*)lo) + LARGE_OBJECT_HEADER_SIZE);
+}
+
+static inline large_object_t *block_large_object(used_block_t *blk) {
+    assert (BLOCK_LARGE(blk));
+    return (large_object_t*)(((char*)blk) - LARGE_OBJECT_HEADER_SIZE);
+}
+
+
+/* ---------- Chunk pool ---------- */
+/* Heaps come and go with tasks, so chunks are recycled process-wide rather
+ * than going back to malloc. Free chunks sit in a small per-thread cache, with
+ * lock-free stacks shared by all threads behind it. When those are empty we
+ * map a new slab of chunks. Each shared stack's top holds a version tag in the
+ * low bits, which chunk alignment leaves clear, to avoid ABA problems; popping
+ * may read the `next' field of a chunk some other thread has just taken, which
+ * is harmless since slabs stay mapped.
+ *
+ * A chunk's pages live on the NUMA node of whichever CPU first touched them.
+ * So the thread that maps a slab keeps it, and hands its chunks out to itself
+ * one at a time, untouched until then. Shared chunks are kept in one stack per
+ * CPU package, that of the thread that first touched them, and threads look in
+ * their own package's stack before the others'.
+ */
+#define CHUNK_TAG_MASK ((uintptr_t) GC_CHUNK_SIZE - 1)
+
+static_assert(!(GC_CHUNK_SIZE & (GC_CHUNK_SIZE - 1)),
+              "GC_CHUNK_SIZE must be a power of two");
+static_assert(GC_CHUNK_SLAB_SIZE % GC_CHUNK_SIZE == 0,
+              "slabs must hold a whole number of chunks");
+
+struct ChunkPool {
+    std::atomic<uintptr_t> top;
+    char pad[CACHE_LINE_SIZE - sizeof(std::atomic<uintptr_t>)];
+};
+
+static ChunkPool shared_chunks[GC_CHUNK_POOLS];
+static bool use_huge_pages = GC_HUGE_PAGES;
+
+static inline size_t current_pool() {
+    return current_package() % GC_CHUNK_POOLS;
+}
+
+static void push_shared_chunk(chunk_t *chunk) {
+    assert (ALIGNED(GC_CHUNK_SIZE, (uintptr_t) chunk));
+    std::atomic<uintptr_t> *pool = &shared_chunks[chunk->pool].top;
+    uintptr_t top = pool->load(std::memory_order_relaxed);
+    uintptr_t new_top;
+    do {
+        chunk->next = (chunk_t*)(top & ~CHUNK_TAG_MASK);
+        new_top = (uintptr_t) chunk | ((top + 1) & CHUNK_TAG_MASK);
+    } while (!pool->compare_exchange_weak(
+                 top, new_top,
+                 std::memory_order_release, std::memory_order_relaxed));
+}
+
+static chunk_t *pop_shared_chunk(size_t pool_index) {
+    std::atomic<uintptr_t> *pool = &shared_chunks[pool_index].top;
+    uintptr_t top = pool->load(std::memory_order_acquire);
+    uintptr_t new_top;
+    chunk_t *chunk;
+    do {
+        chunk = (chunk_t*)(top & ~CHUNK_TAG_MASK);
+        if (!chunk) return NULL;
+        new_top = (uintptr_t) chunk->next | ((top + 1) & CHUNK_TAG_MASK);
+    } while (!pool->compare_exchange_weak(
+                 top, new_top,
+                 std::memory_order_acquire, std::memory_order_acquire));
+    return chunk;
+}
+
+// Touches a chunk nobody has used yet, so its first page is ours.
+static inline chunk_t *first_touch(char *p) {
+    chunk_t *chunk = (chunk_t*) p;
+    chunk->pool = current_pool();
+    return chunk;
+}
+
+struct ChunkCache {
+    size_t count;
+    chunk_t *chunks[GC_CHUNK_CACHE_SIZE];
+    // The untouched rest of the last slab we mapped.
+    char *slab_next, *slab_end;
+
+    ChunkCache() : count(0), slab_next(NULL), slab_end(NULL) {}
+    // Don't strand chunks when the thread exits.
+    ~ChunkCache() {
+        while (count)
+            push_shared_chunk(chunks[--count]);
+        for (; slab_next < slab_end; slab_next += GC_CHUNK_SIZE)
+            push_shared_chunk(first_touch(slab_next));
+    }
+
+  private:
+    NO_COPY(ChunkCache);
+};
+
+static thread_local ChunkCache chunk_cache;
+
+// Takes the next chunk of our slab, mapping a new one if need be.
+static chunk_t *slab_chunk(ChunkCache *cache) {
+    if (cache->slab_next == cache->slab_end) {
+        char *slab = (char*) map_aligned_pages(GC_CHUNK_SLAB_SIZE,
+                                               GC_CHUNK_SLAB_SIZE);
+        if (use_huge_pages)
+            advise_huge_pages(GC_CHUNK_SLAB_SIZE, slab);
+        stats::add(stats::gc_slabs_mapped);
+        cache->slab_next = slab;
+        cache->slab_end = slab + GC_CHUNK_SLAB_SIZE;
+    }
+    char *p = cache->slab_next;
+    cache->slab_next += GC_CHUNK_SIZE;
+    return first_touch(p);
+}
+
+// Tries our package's pool, then our slab, then other packages' pools, and
+// maps a new slab only if all of them are empty.
+static chunk_t *shared_or_slab_chunk(ChunkCache *cache) {
+    size_t home = current_pool();
+    if (chunk_t *chunk = pop_shared_chunk(home))
+        return chunk;
+    if (cache->slab_next != cache->slab_end)
+        return slab_chunk(cache);
+    for (size_t i = 1; i < GC_CHUNK_POOLS; ++i) {
+        if (chunk_t *chunk = pop_shared_chunk((home + i) % GC_CHUNK_POOLS))
+            return chunk;
+    }
+    return slab_chunk(cache);
+}
+
+// Returns a chunk with at least `size' bytes, its size field set.
+static chunk_t *chunk_alloc(size_t size) {
+    chunk_t *chunk;
+    if (size > GC_CHUNK_SIZE) {
+        size = ALIGN_UP(page_size(), size);
+        chunk = (chunk_t*) map_pages(size);
+    } else {
+        size = GC_CHUNK_SIZE;
+        ChunkCache *cache = &chunk_cache;
+        if (cache->count)
+            chunk = cache->chunks[--cache->count];
+        else
+            chunk = shared_or_slab_chunk(cache);
+    }
+    chunk->size = size;
+    stats::add(stats::gc_chunks_acquired);
+    return chunk;
+}
+
+static void chunk_free(chunk_t *chunk) {
+    stats::add(stats::gc_chunks_released);
+    if (chunk->size > GC_CHUNK_SIZE) {
+        unmap_pages(chunk->size, chunk);
+        return;
+    }
+
+    ChunkCache *cache = &chunk_cache;
+    if (cache->count == GC_CHUNK_CACHE_SIZE) {
+        // Keep half, so that alternating frees and allocations stay local.
+        while (cache->count > GC_CHUNK_CACHE_SIZE / 2)
+            push_shared_chunk(cache->chunks[--cache->count]);
+    }
+    cache->chunks[cache->count++] = chunk;
+}
+
+
 /* ---------- Contexts and Heaps ---------- */
 // Carefully calculated so that we GC when we use up our initial chunk.
 #define INITIAL_OLD_SPACE                                               \
-    ((size_t)((MIN_CHUNK_SIZE - CHUNK_HEADER_SIZE) / GC_NEWSPACE_RATIO))
+    ((size_t)((GC_CHUNK_SIZE - CHUNK_HEADER_SIZE) / GC_NEWSPACE_RATIO))
+
+struct FreeList {
+    free_block_t *head, *tail;
+};
 
 struct Heap {
-    chunk_t *chunks;
-    free_block_t *free_head, *free_tail;
+    chunk_t *chunks, *chunks_tail;
+    // Chunks the last collection marked but we haven't swept yet. None of
+    // their free space is on the free lists.
+    chunk_t *unswept, *unswept_tail;
+    large_object_t *large, *large_tail;
+    FreeList free[NUM_SIZE_CLASSES];
+    unsigned long nonempty[CLASS_BITMAP_WORDS]; // which free lists have blocks
+    // Both include large objects.
     size_t used_space;
     size_t old_space;
+    HeapStats stats;
 
-    Heap() : chunks(NULL), free_head(NULL), free_tail(NULL), used_space(0),
-             old_space(INITIAL_OLD_SPACE)
-    {}
+    Heap() : chunks(NULL), chunks_tail(NULL), unswept(NULL),
+             unswept_tail(NULL), large(NULL), large_tail(NULL),
+             used_space(0), old_space(INITIAL_OLD_SPACE) {
+        memset(free, 0, sizeof free);
+        memset(nonempty, 0, sizeof nonempty);
+        memset(&stats, 0, sizeof stats);
+    }
 };
 
 struct Context {
+    detail::AllocState fast;    // must come first; see alloc() in gc.hpp
     Context *parent;
     Context *children;
-    Context *next_child;
+    Context *next_child, *prev_child;
     Heap heap;
-    age_t age;
+    // Guards the list of children, and the fields create() copies from us
+    // (fast.age and nursery_size) against our owner changing them meanwhile.
     pthread_mutex_t lock;
 
-    Context() : parent(NULL), children(NULL), next_child(NULL), heap()
+    // If nursery_size is nonzero, our allocation region is a nursery: objects
+    // from fast.young_start up to fast.cursor get evacuated to the free-list
+    // heap when it fills up. Objects below it have been pinned there.
+    size_t nursery_size;
+    // Bump allocation from our region is counted in the stats up to here.
+    char *counted;
+    // Objects allocated outside the nursery since its last collection, which
+    // may point into it.
+    PtrStack young_objects;
+
+    // Pointers into our heap from our ancestors' objects, as pairs of the
+    // ancestor's object and ours (see write()). Ours are collected only as
+    // part of this set. Appended to by our descendants too, so under
+    // remembered_lock, which a collection holds while marking.
+    PtrStack remembered;
+    // Objects of ours that our descendants have overwritten pointers to in
+    // our objects, and so may still be using (see write()). Also under
+    // remembered_lock.
+    PtrStack shaded;
+    pthread_mutex_t remembered_lock;
+
+    // While we are suspended and no helper has taken us, our owner's
+    // find_roots_data, and our place in `suspended'. Under suspended_lock.
+    void *suspended_roots;
+    Context *next_suspended, *prev_suspended;
+    // Set while a helper collects us. Under `lock', and signalled on
+    // `collected' when it clears.
+    bool collecting;
+    pthread_cond_t collected;
+
+    Context() : parent(NULL), children(NULL), next_child(NULL),
+                prev_child(NULL), heap(),
+                nursery_size(0), counted(NULL),
+                suspended_roots(NULL), next_suspended(NULL),
+                prev_suspended(NULL), collecting(false)
     {
-        if (pthread_mutex_init(&lock, NULL))
+        fast.cursor = fast.limit = fast.young_start = fast.held = NULL;
+        fast.age = fast.base_age = 0;
+
+        if (pthread_mutex_init(&lock, NULL)
+            || pthread_mutex_init(&remembered_lock, NULL))
             die("could not initialize mutex");
+        if (pthread_cond_init(&collected, NULL))
+            die("could not initialize condition variable");
     }
 
     ~Context() {
-        if (pthread_mutex_destroy(&lock))
+        if (pthread_mutex_destroy(&lock)
+            || pthread_mutex_destroy(&remembered_lock))
             die("could not destroy mutex");
+        if (pthread_cond_destroy(&collected))
+            die("could not destroy condition variable");
     }
 };
 
+static_assert(offsetof(Context, fast) == 0,
+              "the allocation fast path can't find Context::fast");
+
 
+/* ---------- Free lists ---------- */
+static inline void set_nonempty(Heap *heap, size_t cls) {
+    heap->nonempty[cls / BITS_PER_WORD] |= 1UL << (cls % BITS_PER_WORD);
+}
+
+static inline void clear_nonempty(Heap *heap, size_t cls) {
+    heap->nonempty[cls / BITS_PER_WORD] &= ~(1UL << (cls % BITS_PER_WORD));
+}
+
+// Returns the first class >= `cls' with a non-empty free list, or
+// NUM_SIZE_CLASSES if there is none.
+static size_t next_nonempty_class(Heap *heap, size_t cls) {
+    size_t word = cls / BITS_PER_WORD;
+    if (word >= CLASS_BITMAP_WORDS) return NUM_SIZE_CLASSES;
+    unsigned long bits = heap->nonempty[word] & (~0UL << (cls % BITS_PER_WORD));
+    while (!bits) {
+        if (++word == CLASS_BITMAP_WORDS) return NUM_SIZE_CLASSES;
+        bits = heap->nonempty[word];
+    }
+    return word * BITS_PER_WORD + __builtin_ctzl(bits);
+}
+
+static void add_to_free_list(Heap *heap, free_block_t *blk) {
+    assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk)
+            && BLOCK_SIZE(blk) >= MIN_BLOCK_SIZE);
+    size_t cls = size_class(BLOCK_SIZE(blk));
+    FreeList *list = &heap->free[cls];
+    blk->next = list->head;
+    if (!list->head) {
+        list->tail = blk;
+        set_nonempty(heap, cls);
+    }
+    list->head = blk;
+}
+
+// Like add_to_free_list(), but at the end, so that a sweep leaves each list in
+// address order.
+static void append_to_free_list(Heap *heap, free_block_t *blk) {
+    assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk)
+            && BLOCK_SIZE(blk) >= MIN_BLOCK_SIZE);
+    size_t cls = size_class(BLOCK_SIZE(blk));
+    FreeList *list = &heap->free[cls];
+    blk->next = NULL;
+    if (list->head) {
+        list->tail->next = blk;
+    } else {
+        list->head = blk;
+        set_nonempty(heap, cls);
+    }
+    list->tail = blk;
+}
+
+static void remove_from_free_list(
+    Heap *heap, size_t cls, free_block_t *prev, free_block_t *blk)
+{
+    FreeList *list = &heap->free[cls];
+    assert (prev ? prev->next == blk : list->head == blk);
+
+    if (prev)
+        prev->next = blk->next;
+    else
+        list->head = blk->next;
+    if (list->tail == blk)
+        list->tail = prev;
+
+    if (!list->head) {
+        assert (!list->tail);
+        clear_nonempty(heap, cls);
+    }
+}
+
+// How many blocks of a power-of-two bin we look at before trying bigger bins.
+#define FIRST_FIT_SCAN_LIMIT 8
+
+// Scans the free list for class `cls' for a block of at least `size' bytes,
+// giving up after `limit' blocks. Removes and returns the block, or NULL.
+static free_block_t *scan_free_list(
+    Heap *heap, size_t cls, size_t size, size_t limit)
+{
+    free_block_t *prev = NULL, *blk = heap->free[cls].head;
+    size_t steps = 0;
+    for (; blk && limit--; prev = blk, blk = blk->next) {
+        assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk));
+        ++steps;
+        if (size <= BLOCK_SIZE(blk)) {
+            remove_from_free_list(heap, cls, prev, blk);
+            stats::add(stats::gc_free_list_steps, steps);
+            return blk;
+        }
+    }
+    stats::add(stats::gc_free_list_steps, steps);
+    return NULL;
+}
+
+// Finds a free block of at least `size' bytes and removes it from its free
+// list. Returns NULL if there is none, or if `thorough' is false and there is
+// no quick way to find one.
+static free_block_t *find_free_block(
+    Heap *heap, size_t size, bool thorough = true)
+{
+    size_t cls = size_class(size);
+    size_t bin = NUM_SIZE_CLASSES;
+    stats::add(stats::gc_free_list_searches);
+
+    if (cls >= NUM_SMALL_CLASSES && heap->free[cls].head) {
+        // Blocks in a power-of-two bin may be smaller than we need, so search
+        // it first-fit; but not for long, since a fragmented heap can have
+        // thousands of blocks just too small.
+        free_block_t *blk = scan_free_list(heap, cls, size,
+                                           FIRST_FIT_SCAN_LIMIT);
+        if (blk) return blk;
+        bin = cls++;
+    }
+
+    // Any block in the first non-empty class from here up is big enough.
+    cls = next_nonempty_class(heap, cls);
+    if (cls == NUM_SIZE_CLASSES) {
+        // Last resort: the rest of the bin.
+        return bin == NUM_SIZE_CLASSES || !thorough
+            ? NULL : scan_free_list(heap, bin, size, SIZE_MAX);
+    }
+    free_block_t *blk = heap->free[cls].head;
+    assert (size <= BLOCK_SIZE(blk));
+    remove_from_free_list(heap, cls, NULL, blk);
+    return blk;
+}
+
+
 /* ---------- ALLOCATION ---------- */
 
+// Objects bigger than this skip bump allocation, so they don't use up regions;
+// alloc() and alloc_n() in gc.hpp send them straight here.
+#define MAX_BUMP_ALLOC_SIZE detail::MAX_BUMP_ALLOC_SIZE
+static_assert(GC_LARGE_OBJECT_SIZE > MAX_BUMP_ALLOC_SIZE,
+              "large objects would be bump-allocated");
+
 // helper function forward decls
-static void check_for_alloc_gc(Heap *heap, size_t extra, void *find_roots_data);
+static void check_for_alloc_gc(
+    Context *cx, size_t extra, void *find_roots_data);
 static free_block_t *split_block(Heap *heap, free_block_t *blk, size_t size);
-static void remove_from_free_list(
-    Heap *heap, free_block_t *prev, free_block_t *blk);
 static free_block_t *get_block_from_new_chunk(Heap *heap, size_t size);
+static free_block_t *sweep_for(Heap *heap, size_t size);
+static used_block_t *alloc_block(Context *cx, size_t real_size);
+static used_block_t *alloc_large(Context *cx, size_t real_size);
+static void retire_region(Context *cx);
+static void refill_region(Context *cx, size_t size);
+static void next_nursery(Context *cx, size_t size, void *find_roots_data);
 
-ptr_t alloc(Context *cx, size_t size, void *find_roots_data) {
-    size_t real_size = BLOCK_SIZE_ALIGN(USED_BLOCK_HEADER_SIZE + size);
-    Heap *heap = &cx->heap;
+// Replaces our region with one at least `size' bytes big.
+static void next_region(Context *cx, size_t size, void *find_roots_data) {
+    if (cx->nursery_size) {
+        next_nursery(cx, size, find_roots_data);
+    } else {
+        // Give back what's left of the old region (so that the heap is
+        // walkable if we GC), and get a new one.
+        retire_region(cx);
+        check_for_alloc_gc(cx, MAX(size, GC_MIN_REGION_SIZE),
+                           find_roots_data);
+        refill_region(cx, size);
+    }
+    assert (size <= (size_t)(cx->fast.limit - cx->fast.cursor));
+}
 
-    // Check whether allocating would exceed our limits. If so, run a GC cycle.
-    check_for_alloc_gc(heap, real_size, find_roots_data);
+// Allocates an object outside the region, from the free lists or the
+// large-object space. Never GCs.
+static ptr_t alloc_unbumped(Context *cx, size_t real_size, layout_t layout) {
+    used_block_t *blk = real_size >= GC_LARGE_OBJECT_SIZE
+        ? alloc_large(cx, real_size)
+        : alloc_block(cx, real_size);
+    blk->layout = layout;
+    stats::add(stats::gc_bytes_allocated, real_size);
+    ptr_t obj = block_to_ptr(blk);
+    if (cx->nursery_size && layout != LAYOUT_NOPTRS)
+        ptr_stack_push(&cx->young_objects, obj);
+    return obj;
+}
 
-    // Search for a free block to use.
-    free_block_t *prev = NULL, *blk = heap->free_head;
-    while (blk) {
-        assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk));
-        if (real_size <= BLOCK_SIZE(blk))
-            break;              // found a block
-        prev = blk;
-        blk = blk->next;
+/* Most objects are bump-allocated inline by alloc() in gc.hpp, from a region
+ * of free space owned by the context. We only get here once that region is
+ * too small, or for objects bigger than MAX_BUMP_ALLOC_SIZE.
+ */
+ptr_t detail::alloc_slow(Context *cx, size_t size, void *find_roots_data,
+                         layout_t layout)
+{
+    size_t real_size = detail::block_size(size);
+    stats::add(stats::gc_slow_allocs);
+
+    if (real_size <= MAX_BUMP_ALLOC_SIZE) {
+        next_region(cx, real_size, find_roots_data);
+        return carve(cx, real_size, layout);
     }
 
+    // Check whether allocating would exceed our limits. If so, run a GC cycle.
+    check_for_alloc_gc(cx, real_size, find_roots_data);
+    return alloc_unbumped(cx, real_size, layout);
+}
+
+// Like alloc_slow(), but checks for a GC once for all the objects, so that
+// none of them can move or die before the client initializes them.
+void detail::alloc_n_slow(Context *cx, size_t n, size_t size,
+                          const size_t *sizes, ptr_t *objs,
+                          void *find_roots_data, layout_t layout)
+{
+    stats::add(stats::gc_slow_allocs);
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i)
+        total += detail::block_size(sizes ? sizes[i] : size);
+    check_for_alloc_gc(cx, total, find_roots_data);
+    for (size_t i = 0; i < n; ++i)
+        objs[i] = alloc_unbumped(
+            cx, detail::block_size(sizes ? sizes[i] : size), layout);
+}
+
+// Bulk allocations of small objects reserve room for all of them in the
+// region, so that none of them can trigger a GC.
+void detail::reserve_slow(Context *cx, size_t size, void *find_roots_data) {
+    stats::add(stats::gc_slow_allocs);
+    next_region(cx, size, find_roots_data);
+}
+
+// Allocates a block from the free lists, or a new chunk. Never GCs.
+static used_block_t *alloc_block(Context *cx, size_t real_size) {
+    Heap *heap = &cx->heap;
+
+    free_block_t *blk = find_free_block(heap, real_size);
+    if (!blk)
+        blk = sweep_for(heap, real_size);
     if (!blk) {
         // Didn't find an block to allocate!
         blk = get_block_from_new_chunk(heap, real_size);
-        prev = NULL;            // new block is on front of free list
     }
 
     // If the block is large enough, we can just split it.
     if (BLOCK_SIZE(blk) - real_size >= MIN_BLOCK_SIZE) {
         // Split the block.
         blk = split_block(heap, blk, real_size);
-    } else {
-        // Allocate the entire block.
-        remove_from_free_list(heap, prev, blk);
     }
 
     used_block_t *block = block_make_used(blk);
-    block->age = cx->age;
+    block->age = cx->fast.age;
+    heap->used_space += BLOCK_SIZE(block);
     assert (BLOCK_USED(blk) && !BLOCK_MARKED(blk));
-    return block_to_ptr(block);
+    return block;
+}
+
+// Maps a large object of its own. Never GCs.
+static used_block_t *alloc_large(Context *cx, size_t real_size) {
+    Heap *heap = &cx->heap;
+    size_t map_size = ALIGN_UP(page_size(), LARGE_OBJECT_HEADER_SIZE + real_size);
+    large_object_t *lo = (large_object_t*) map_pages(map_size);
+    lo->map_size = map_size;
+    lo->marked.store(false, std::memory_order_relaxed);
+    lo->next = heap->large;
+    heap->large = lo;
+    if (!lo->next)
+        heap->large_tail = lo;
+
+    used_block_t *block = large_object_block(lo);
+    block->size = real_size | BLOCK_USED_FLAG | BLOCK_LARGE_FLAG;
+    block->age = cx->fast.age;
+    heap->used_space += real_size;
+    stats::add(stats::gc_large_objects);
+    return block;
 }
 
-static void check_for_alloc_gc(Heap *heap, size_t extra, void *find_roots_data)
+// Counts what has been bump-allocated since we last looked.
+static inline void count_region_allocation(Context *cx) {
+    stats::add(stats::gc_bytes_allocated, cx->fast.cursor - cx->counted);
+    cx->counted = cx->fast.cursor;
+}
+
+static void start_region(Context *cx, free_block_t *blk) {
+    assert (!cx->fast.cursor);
+    // The whole region counts as used until we retire it.
+    cx->fast.cursor = cx->counted = (char*) blk;
+    cx->fast.limit = cx->fast.cursor + BLOCK_SIZE(blk);
+    cx->fast.young_start = cx->nursery_size ? cx->fast.cursor : cx->fast.limit;
+    cx->heap.used_space += BLOCK_SIZE(blk);
+}
+
+// Makes a free block big enough for `size' bytes into our new region.
+static void refill_region(Context *cx, size_t size) {
+    Heap *heap = &cx->heap;
+
+    // Prefer a decent-sized block, but make do with what we can find before
+    // getting a new chunk.
+    free_block_t *blk = find_free_block(
+        heap, MAX(size, GC_MIN_REGION_SIZE), false);
+    if (!blk)
+        blk = find_free_block(heap, size);
+    if (!blk)
+        blk = sweep_for(heap, size);
+    if (!blk)
+        blk = get_block_from_new_chunk(heap, size);
+
+    start_region(cx, blk);
+}
+
+// Turns the unused end of our region back into a free block. Anything in the
+// nursery stays where it is, and becomes part of the free-list heap.
+static void retire_region(Context *cx) {
+    Heap *heap = &cx->heap;
+    size_t left = cx->fast.limit - cx->fast.cursor;
+    count_region_allocation(cx);
+
+    if (left) {
+        free_block_t *blk = (free_block_t*) cx->fast.cursor;
+        blk->size = left;
+        assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk));
+        // Blocks too small to allocate from stay off the free lists; they
+        // just fill space so that chunks can be walked block by block.
+        if (left >= MIN_BLOCK_SIZE)
+            add_to_free_list(heap, blk);
+        heap->used_space -= left;
+    }
+
+    cx->fast.cursor = cx->fast.limit = cx->fast.young_start = NULL;
+    cx->counted = NULL;
+    cx->young_objects.depth = 0;
+}
+
+static void minor_collect(Context *cx, void *find_roots_data);
+
+static void count_pause(uint64_t start) {
+#if STATS_ENABLED
+    uint64_t ns = now_ns() - start;
+    stats::add(stats::gc_pause_ns, ns);
+    stats::record(stats::gc_max_pause_ns, ns);
+#else
+    (void) start;
+#endif
+}
+
+// Called when the nursery is full. Empties it, or gets a new one if pinned
+// objects have left too little of it.
+static void next_nursery(Context *cx, size_t size, void *find_roots_data) {
+    uint64_t start = STATS_ENABLED ? now_ns() : 0;
+    minor_collect(cx, find_roots_data);
+    count_pause(start);
+    check_for_alloc_gc(cx, 0, find_roots_data);
+
+    size_t avail = cx->fast.limit - cx->fast.young_start;
+    if (cx->fast.cursor && avail >= size && avail >= cx->nursery_size / 2)
+        return;
+
+    retire_region(cx);
+    size_t want = MAX(size, cx->nursery_size);
+    free_block_t *blk = find_free_block(&cx->heap, want);
+    if (!blk)
+        blk = sweep_for(&cx->heap, want);
+    if (!blk)
+        blk = get_block_from_new_chunk(&cx->heap, want);
+    if (BLOCK_SIZE(blk) - want >= MIN_BLOCK_SIZE)
+        blk = split_block(&cx->heap, blk, want);
+    start_region(cx, blk);
+}
+
+static void collect(Context *cx, void *find_roots_data);
+
+static void check_for_alloc_gc(
+    Context *cx, size_t extra, void *find_roots_data)
 {
-    // die("unimplemented");   // FIXME
-    (void) heap;
-    (void) extra;
-    (void) find_roots_data;
+    Heap *heap = &cx->heap;
+    if (heap->used_space + extra > heap->old_space * GC_NEWSPACE_RATIO)
+        collect(cx, find_roots_data);
 }
 
+// The returned block is not on any free list.
 static free_block_t *get_block_from_new_chunk(Heap *heap, size_t reqsz) {
-    size_t size = MIN(MIN_CHUNK_SIZE, CHUNK_HEADER_SIZE + reqsz);
-    chunk_t *chunk = (chunk_t*) smalloc(size);
-    chunk->size = size;
+    chunk_t *chunk = chunk_alloc(CHUNK_HEADER_SIZE + reqsz);
+    size_t size = chunk->size;
     chunk->next = heap->chunks;
     heap->chunks = chunk;
+    if (!chunk->next)
+        heap->chunks_tail = chunk;
 
     free_block_t *block = (free_block_t*)(((char*)chunk) + CHUNK_HEADER_SIZE);
     assert (ALIGNED(MACHINE_ALIGNMENT, (uintptr_t) block));
@@ -207,16 +849,11 @@ static free_block_t *get_block_from_new_chunk(Heap *heap, size_t reqsz) {
     block->size = size - CHUNK_HEADER_SIZE;
     assert (BLOCK_FREE(block) && !BLOCK_MARKED(block));
 
-    // Push block on front of free list.
-    block->next = heap->free_head;
-    heap->free_head = block;
-    if (!block->next) {
-        heap->free_tail = block;
-    }
-
     return block;
 }
 
+// Carves `size' bytes off the end of `blk', which must not be on a free list,
+// and puts the rest of `blk' on the appropriate free list.
 static free_block_t *split_block(Heap *heap, free_block_t *blk, size_t size) {
     size_t blk_size = BLOCK_SIZE(blk);
     size_t new_size = blk_size - size;
@@ -233,63 +870,924 @@ static free_block_t *split_block(Heap *heap, free_block_t *blk, size_t size) {
     assert (BLOCK_FREE(blk) && !BLOCK_MARKED(blk)
             && BLOCK_FREE(split) && !BLOCK_MARKED(split));
 
+    add_to_free_list(heap, blk);
     return split;
-    (void) heap;
 }
 
-static void remove_from_free_list(
-    Heap *heap, free_block_t *prev, free_block_t *blk)
+
+/* ---------- GARBAGE COLLECTION ---------- */
+/* A cycle collects a single heap: we mark everything reachable from the
+ * client's roots, then leave the heap's chunks to be swept lazily. Allocation
+ * sweeps them one at a time, as it runs out of free blocks, and the next cycle
+ * sweeps whatever is left before it starts marking.
+ * Marking only follows pointers into the heap being collected. Anything older
+ * than the heap's base age belongs to an ancestor, which we can see but must
+ * not touch.
+ */
+
+struct MarkJob;
+
+struct CycleContext {
+    Context *cx;
+    age_t base_age;
+    // Set if other threads may be marking the same heap.
+    MarkJob *job;
+    // Total size of the blocks we marked, or in a minor collection, evacuated.
+    size_t marked_bytes;
+    // Marked objects whose fields we have yet to scan. In a minor collection,
+    // evacuated objects whose fields we have yet to scan.
+    PtrStack grey;
+    // If this is a minor collection, the part of the nursery being evacuated.
+    bool minor;
+    char *young_lo, *young_hi;
+
+    explicit CycleContext(Context *c)
+        : cx(c), base_age(c->fast.base_age), job(NULL), marked_bytes(0),
+          minor(false),
+          young_lo(NULL), young_hi(NULL)
+    {}
+
+  private:
+    NO_COPY(CycleContext);
+};
+
+static inline void mark_block_of(CycleContext *cycx, ptr_t ptr,
+                                 used_block_t *blk)
 {
-    assert (!prev || prev->next == blk);
-    free_block_t *head = heap->free_head,
-                 *tail = heap->free_tail;
+    size_t size;
+    if (BLOCK_LARGE(blk)) {
+        large_object_t *lo = block_large_object(blk);
+        if (cycx->job) {
+            if (lo->marked.exchange(true, std::memory_order_relaxed))
+                return;
+        } else {
+            if (lo->marked.load(std::memory_order_relaxed))
+                return;
+            lo->marked.store(true, std::memory_order_relaxed);
+        }
+        size = BLOCK_SIZE(blk);
+    } else if (cycx->job) {
+        // Race other markers for it.
+        size_t old = __atomic_fetch_or(
+            &blk->size, (size_t) BLOCK_MARKED_FLAG, __ATOMIC_RELAXED);
+        assert (old & BLOCK_USED_FLAG);
+        if (old & BLOCK_MARKED_FLAG)
+            return;
+        size = old & ~BLOCK_INFO_MASK;
+    } else {
+        assert (BLOCK_USED(blk));
+        if (BLOCK_MARKED(blk))
+            return;
+        mark_block(blk);
+        size = BLOCK_SIZE(blk);
+    }
+
+    cycx->marked_bytes += size;
+    if (blk->layout != LAYOUT_NOPTRS)
+        ptr_stack_push(&cycx->grey, ptr);
+}
+
+// Remembered objects are left to mark_remembered(), so that no collection of
+// an ancestor's heap marks objects of ours through its pointers to them.
+// `slot' may be written concurrently by write() in a descendant, which sets
+// the flag before it releases the store, so we load it with acquire.
+static inline void mark_ptr(CycleContext *cycx, ptr_t *slot) {
+    ptr_t ptr = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!ptr) return;
+    used_block_t *blk = block_from_ptr(ptr);
+    age_t age = __atomic_load_n(&blk->age, __ATOMIC_RELAXED);
+    if (age < cycx->base_age || (age & AGE_REMEMBERED))
+        return;
+    mark_block_of(cycx, ptr, blk);
+}
+
+// Marks the objects in our remembered set, and the shaded ones. Once we have
+// no children, nobody but us can be using the shaded objects, and we have them
+// in our roots if we need them, so we forget them instead. Call with
+// remembered_lock held.
+static void mark_remembered(CycleContext *cycx) {
+    Context *cx = cycx->cx;
+    PtrStack *rs = &cx->remembered;
+    for (size_t i = 1; i < rs->depth; i += 2) {
+        used_block_t *blk = block_from_ptr(rs->items[i]);
+        assert ((blk->age & ~AGE_REMEMBERED) >= cycx->base_age);
+        mark_block_of(cycx, rs->items[i], blk);
+    }
+
+    if (pthread_mutex_lock(&cx->lock)) die("could not lock mutex");
+    bool children = cx->children != NULL;
+    if (pthread_mutex_unlock(&cx->lock)) die("could not unlock mutex");
+    PtrStack *shaded = &cx->shaded;
+    if (!children)
+        shaded->depth = 0;
+    for (size_t i = 0; i < shaded->depth; ++i) {
+        ptr_t obj = shaded->items[i];
+        mark_block_of(cycx, obj, block_from_ptr(obj));
+    }
+}
 
-    if (prev && blk->next) {
-        // blk isn't the head or the tail
-        assert (blk != head && blk != tail);
+/* An evacuated nursery object is left marked (nursery objects are otherwise
+ * never marked), with the address of its copy in place of its size.
+ */
+static inline void block_forward(used_block_t *blk, used_block_t *copy) {
+    assert (ALIGNED(BLOCK_SIZE_ALIGNMENT, (uintptr_t) copy));
+    blk->size = (uintptr_t) copy | BLOCK_USED_FLAG | BLOCK_MARKED_FLAG;
+}
 
-        prev->next = NULL;
-        tail->next = head;
-        heap->free_head = blk->next;
-        heap->free_tail = prev;
+static inline used_block_t *block_forwarded_to(used_block_t *blk) {
+    assert (BLOCK_USED(blk) && BLOCK_MARKED(blk));
+    return (used_block_t*) BLOCK_SIZE(blk);
+}
+
+static inline void evacuate(CycleContext *cycx, ptr_t *slot) {
+    char *ptr = (char*) *slot;
+    if (ptr < cycx->young_lo || ptr >= cycx->young_hi)
+        return;                 // NULL, or not in the nursery
+
+    used_block_t *blk = block_from_ptr(ptr);
+    if (BLOCK_MARKED(blk)) {
+        *slot = block_to_ptr(block_forwarded_to(blk));
+        return;
     }
-    else if (!prev) {
-        // we just used the head
-        assert (blk == head && blk != tail);
-        heap->free_head = blk->next;
+
+    size_t size = BLOCK_SIZE(blk);
+    used_block_t *copy = alloc_block(cycx->cx, size);
+    memcpy(block_to_ptr(copy), ptr, size - USED_BLOCK_HEADER_SIZE);
+    copy->age = blk->age;
+    copy->layout = blk->layout;
+    block_forward(blk, copy);
+    cycx->marked_bytes += size;
+
+    *slot = block_to_ptr(copy);
+    if (copy->layout != LAYOUT_NOPTRS)
+        ptr_stack_push(&cycx->grey, *slot);
+}
+
+void found_roots(CycleContext *cx, size_t nroots, ptr_t *roots) {
+    if (cx->minor) {
+        for (size_t i = 0; i < nroots; ++i)
+            evacuate(cx, &roots[i]);
+    } else {
+        for (size_t i = 0; i < nroots; ++i)
+            mark_ptr(cx, &roots[i]);
     }
-    else if (!blk->next) {
-        // we just used the tail
-        assert (blk != head && blk == tail);
-        prev->next = NULL;
-        heap->free_tail = prev;
+}
+
+void found_ptrs(CycleContext *cx, size_t nptrs, ptr_t *ptrs) {
+    if (cx->minor) {
+        for (size_t i = 0; i < nptrs; ++i)
+            evacuate(cx, &ptrs[i]);
+    } else {
+        for (size_t i = 0; i < nptrs; ++i)
+            mark_ptr(cx, &ptrs[i]);
+    }
+}
+
+// Scans the fields of an object we marked or evacuated. Only objects with
+// custom layouts need the client's help.
+static inline void scan_object(CycleContext *cycx, ptr_t obj) {
+    layout_t layout = block_from_ptr(obj)->layout;
+    ptr_t *fields = (ptr_t*) obj;
+    switch (layout & detail::LAYOUT_KIND_MASK) {
+    case LAYOUT_CUSTOM:
+        client::find_ptrs(cycx, obj);
+        break;
+    case LAYOUT_NOPTRS:
+        break;
+    case detail::LAYOUT_PREFIX:
+        found_ptrs(cycx, layout >> detail::LAYOUT_KIND_BITS, fields);
+        break;
+    case detail::LAYOUT_BITMAP:
+        for (uint32_t bits = layout >> detail::LAYOUT_KIND_BITS; bits;
+             bits &= bits - 1)
+            found_ptrs(cycx, 1, &fields[__builtin_ctz(bits)]);
+        break;
     }
-    else {
-        // we just used the only block, which is both head & tail
-        assert (blk == head && blk == tail);
-        heap->free_head = heap->free_tail = NULL;
+}
+
+/* Copies everything reachable in the nursery out to the free-list heap, then
+ * empties it. Costs time proportional to what survives, not to the size of the
+ * heap. The pointers that can reach the nursery are the roots, and fields of
+ * objects allocated since the nursery was last emptied: those in the
+ * nursery, those in young_objects, and the copies we make.
+ *
+ * Held objects (see hold()) get pinned first. Those may point at younger
+ * objects without write() having told us, so if we go on to evacuate the rest
+ * we must scan them too, this once. When most of the nursery is held, which is
+ * usual deep in a tree of forks, we pin all of it instead, and have nothing
+ * to do.
+ */
+static void minor_collect(Context *cx, void *find_roots_data) {
+    count_region_allocation(cx);
+    char *pinned = cx->fast.young_start;
+    char *held = cx->fast.held;
+    if (held > pinned && held <= cx->fast.cursor) {
+        if (cx->fast.cursor - held < held - pinned) {
+            cx->fast.young_start = cx->fast.cursor;
+            cx->young_objects.depth = 0;
+        } else {
+            // A hold taken in a region we have since given up may be
+            // anywhere in this one, even in the middle of a block. Pinning a
+            // bit more than asked is harmless.
+            char *p = pinned;
+            while (p < held)
+                p += BLOCK_SIZE((used_block_t*) p);
+            cx->fast.young_start = p;
+        }
+        stats::add(stats::gc_bytes_held, cx->fast.young_start - pinned);
+    }
+    if (cx->fast.cursor == cx->fast.young_start && !cx->young_objects.depth)
+        return;
+
+    CycleContext cycx(cx);
+    cycx.minor = true;
+    cycx.young_lo = cx->fast.young_start;
+    cycx.young_hi = cx->fast.cursor;
+
+    client::find_roots_alloc(&cycx, find_roots_data);
+    for (size_t i = 0; i < cx->young_objects.depth; ++i)
+        scan_object(&cycx, cx->young_objects.items[i]);
+    cx->young_objects.depth = 0;
+    for (char *p = pinned; p < cycx.young_lo;
+         p += BLOCK_SIZE((used_block_t*) p)) {
+        used_block_t *blk = (used_block_t*) p;
+        if (blk->layout != LAYOUT_NOPTRS)
+            scan_object(&cycx, block_to_ptr(blk));
     }
 
-    assert (heap->free_tail
-            ? (heap->free_head && heap->free_tail->next == NULL)
-            : !heap->free_head);
+    PtrStack *grey = &cycx.grey;
+    while (grey->depth)
+        scan_object(&cycx, grey->items[--grey->depth]);
+
+    cx->fast.cursor = cx->counted = cx->fast.young_start;
+    stats::add(stats::gc_minor_collections);
+    stats::add(stats::gc_bytes_evacuated, cycx.marked_bytes);
 }
 
-
+// Frees unmarked blocks in `chunk', unmarks marked ones and puts its free
+// space on the free lists, coalescing adjacent free blocks. If nothing is left
+// in it, it goes back to the pool.
+static void sweep_chunk(Heap *heap, chunk_t *chunk) {
+    HeapStats *stats = &heap->stats;
+    used_block_t *first = (used_block_t*)(((char*)chunk) + CHUNK_HEADER_SIZE);
+    char *end = ((char*)chunk) + chunk->size;
+
+    size_t chunk_live = 0;
+    for (used_block_t *blk = first; (char*)blk < end;
+         blk = (used_block_t*)(((char*)blk) + BLOCK_SIZE(blk)))
+    {
+        if (!BLOCK_USED(blk)) continue;
+        if (BLOCK_MARKED(blk)) {
+            unmark_block(blk);
+            chunk_live += BLOCK_SIZE(blk);
+        } else {
+            block_make_free(blk);
+        }
+    }
+
+    if (!chunk_live) {
+        chunk_free(chunk);
+        return;
+    }
+
+    // Walking in address order and appending keeps each chunk's free blocks
+    // in address order, so first-fit searches favour low addresses and leave
+    // the ends of chunks in big pieces.
+    used_block_t *blk = first;
+    size_t chunk_free_bytes = 0;
+    while ((char*)blk < end) {
+        if (BLOCK_USED(blk)) {
+            blk = (used_block_t*)(((char*)blk) + BLOCK_SIZE(blk));
+            continue;
+        }
+
+        free_block_t *run = (free_block_t*) blk;
+        size_t run_size = 0;
+        do {
+            run_size += BLOCK_SIZE(blk);
+            blk = (used_block_t*)(((char*)blk) + BLOCK_SIZE(blk));
+        } while ((char*)blk < end && BLOCK_FREE(blk));
+        run->size = run_size;
+
+        if (run_size >= MIN_BLOCK_SIZE) {
+            append_to_free_list(heap, run);
+            ++stats->free_blocks;
+        }
+        chunk_free_bytes += run_size;
+        stats->largest_free_block = MAX(stats->largest_free_block, run_size);
+    }
+    assert ((char*)blk == end);
+
+    stats->min_chunk_free = stats->chunks
+        ? MIN(stats->min_chunk_free, chunk_free_bytes) : chunk_free_bytes;
+    stats->max_chunk_free = MAX(stats->max_chunk_free, chunk_free_bytes);
+    stats->free_bytes += chunk_free_bytes;
+    stats->live_bytes += chunk_live;
+    ++stats->chunks;
+
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+    if (!chunk->next)
+        heap->chunks_tail = chunk;
+}
+
+static chunk_t *take_unswept(Heap *heap) {
+    chunk_t *chunk = heap->unswept;
+    if (chunk) {
+        heap->unswept = chunk->next;
+        if (!heap->unswept)
+            heap->unswept_tail = NULL;
+    }
+    return chunk;
+}
+
+// Sweeps chunks until there is a free block of at least `size' bytes, and
+// takes it. Returns NULL if there are no unswept chunks left.
+static free_block_t *sweep_for(Heap *heap, size_t size) {
+    while (chunk_t *chunk = take_unswept(heap)) {
+        sweep_chunk(heap, chunk);
+        if (free_block_t *blk = find_free_block(heap, size))
+            return blk;
+    }
+    return NULL;
+}
+
+static void finish_sweeping(Heap *heap) {
+    while (chunk_t *chunk = take_unswept(heap))
+        sweep_chunk(heap, chunk);
+}
+
+// Called once marking is done, with all chunks swept. Sets them all to be
+// swept again.
+static void start_sweeping(Heap *heap) {
+    assert (!heap->unswept);
+    heap->unswept = heap->chunks;
+    heap->unswept_tail = heap->chunks_tail;
+    heap->chunks = heap->chunks_tail = NULL;
+
+    memset(heap->free, 0, sizeof heap->free);
+    memset(heap->nonempty, 0, sizeof heap->nonempty);
+    memset(&heap->stats, 0, sizeof heap->stats);
+}
+
+// Unmaps unmarked large objects and unmarks the rest. Returns the number of
+// bytes still in use.
+static size_t sweep_large(Heap *heap) {
+    size_t live = 0;
+    large_object_t **link = &heap->large, *last = NULL;
+    while (large_object_t *lo = *link) {
+        if (!lo->marked.load(std::memory_order_relaxed)) {
+            *link = lo->next;
+            unmap_pages(lo->map_size, lo);
+            continue;
+        }
+        lo->marked.store(false, std::memory_order_relaxed);
+        live += BLOCK_SIZE(large_object_block(lo));
+        ++heap->stats.large_objects;
+        last = lo;
+        link = &lo->next;
+    }
+    heap->large_tail = last;
+    heap->stats.large_object_bytes = live;
+    return live;
+}
+
+/* ---------- Parallel marking ---------- */
+/* Collecting a big heap publishes a MarkJob, which idle scheduler workers can
+ * join through help(). Each participant has its own grey stack and marks with
+ * an atomic test-and-set. Participants with plenty of work hand some of it to
+ * hungry ones through a shared pool of packets. Marking is finished when no
+ * participant has any work and the pool is empty. The job's bookkeeping is all
+ * under its lock. A participant that has been waiting for a while sleeps on
+ * wake_seq, which changes, under the lock, whenever there may be something for
+ * it: a packet, the end of marking, or the last helper leaving.
+ */
+
+struct Packet {
+    Packet *next;
+    size_t count;
+    ptr_t items[GC_MARK_PACKET_SIZE];
+};
+
+struct MarkJob {
+    Context *cx;
+    pthread_mutex_t lock;
+    Packet *packets;
+    int busy;                   // participants that may have work
+    int attached;               // participants, including the collector
+    bool done;
+    size_t marked_bytes;        // by helpers that have left
+    std::atomic<int> hungry;    // participants waiting for a packet
+    int sleepers;               // participants sleeping on wake_seq
+    uint32_t wake_seq;          // futex word
+    MarkJob *next;              // in `jobs'
+
+    explicit MarkJob(Context *c)
+        : cx(c), packets(NULL), busy(1), attached(1), done(false),
+          marked_bytes(0), hungry(0), sleepers(0), wake_seq(0), next(NULL)
+    {
+        if (pthread_mutex_init(&lock, NULL))
+            die("could not initialize mutex");
+    }
+
+    ~MarkJob() {
+        assert (!packets && attached == 0);
+        if (pthread_mutex_destroy(&lock))
+            die("could not destroy mutex");
+    }
+
+  private:
+    NO_COPY(MarkJob);
+};
+
+// See set_wake_hook() and set_num_helpers().
+static void (*wake_fn)(void *data, size_t n) = NULL;
+static void *wake_data = NULL;
+static size_t num_helpers = 0;
+
+static inline void wake_helpers(size_t n) {
+    if (wake_fn) wake_fn(wake_data, n);
+}
+
+void set_wake_hook(void (*fn)(void *data, size_t n), void *data) {
+    wake_data = data;
+    wake_fn = fn;
+}
+
+void set_num_helpers(size_t n) {
+    num_helpers = n;
+}
+
+// Jobs that helpers may join.
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static MarkJob *jobs = NULL;
+static std::atomic<int> njobs(0);
+
+static inline void lock_job(MarkJob *job) {
+    if (pthread_mutex_lock(&job->lock)) die("could not lock mutex");
+}
+
+static inline void unlock_job(MarkJob *job) {
+    if (pthread_mutex_unlock(&job->lock)) die("could not unlock mutex");
+}
+
+// Waits for the job to change: spins for the first GC_MARK_SPIN_LIMIT calls in
+// a row, then sleeps until wake_markers(). Call with the job's lock held;
+// returns with it held again, and the caller checks what changed.
+static void wait_on_job(MarkJob *job, unsigned *spins) {
+    if (++*spins < GC_MARK_SPIN_LIMIT) {
+        unlock_job(job);
+        CPU_RELAX();
+        lock_job(job);
+        return;
+    }
+    uint32_t seq = job->wake_seq;
+    ++job->sleepers;
+    unlock_job(job);
+    futex_wait(&job->wake_seq, seq, 0);
+    stats::add(stats::gc_mark_sleeps);
+    lock_job(job);
+    --job->sleepers;
+}
+
+// Wakes up to `n' participants sleeping in wait_on_job(). Call with the job's
+// lock held, after making the change they are waiting for.
+static void wake_markers(MarkJob *job, int n) {
+    if (!job->sleepers) return;
+    __atomic_store_n(&job->wake_seq, job->wake_seq + 1, __ATOMIC_RELAXED);
+    futex_wake(&job->wake_seq, n);
+}
+
+// Moves up to half of our grey objects into the shared pool.
+static void share_work(CycleContext *cycx) {
+    PtrStack *grey = &cycx->grey;
+    size_t n = MIN(grey->depth / 2, (size_t) GC_MARK_PACKET_SIZE);
+    Packet *p = (Packet*) smalloc(sizeof(Packet));
+    p->count = n;
+    grey->depth -= n;
+    memcpy(p->items, grey->items + grey->depth, n * sizeof(ptr_t));
+
+    MarkJob *job = cycx->job;
+    lock_job(job);
+    p->next = job->packets;
+    job->packets = p;
+    wake_markers(job, 1);
+    unlock_job(job);
+}
+
+// Called when we have run out of work. Returns true once we have more, or
+// false if marking is finished.
+static bool wait_for_work(CycleContext *cycx) {
+    MarkJob *job = cycx->job;
+    unsigned spins = 0;
+
+    lock_job(job);
+    --job->busy;
+    ++job->hungry;
+    for (;;) {
+        if (Packet *p = job->packets) {
+            job->packets = p->next;
+            ++job->busy;
+            --job->hungry;
+            unlock_job(job);
+
+            for (size_t i = 0; i < p->count; ++i)
+                ptr_stack_push(&cycx->grey, p->items[i]);
+            sfree(sizeof(Packet), p);
+            return true;
+        }
+
+        if (!job->busy || job->done) {
+            if (!job->done) {
+                job->done = true;
+                wake_markers(job, INT_MAX);
+            }
+            --job->hungry;
+            unlock_job(job);
+            return false;
+        }
+
+        wait_on_job(job, &spins);
+    }
+}
+
+static void mark_loop(CycleContext *cycx) {
+    MarkJob *job = cycx->job;
+    PtrStack *grey = &cycx->grey;
+    for (;;) {
+        while (grey->depth) {
+            if (grey->depth > 1 && job->hungry.load(std::memory_order_relaxed))
+                share_work(cycx);
+            scan_object(cycx, grey->items[--grey->depth]);
+        }
+        if (!wait_for_work(cycx))
+            return;
+    }
+}
+
+static bool help_mark() {
+    if (!njobs.load(std::memory_order_relaxed))
+        return false;
+
+    MarkJob *job = NULL;
+    if (pthread_mutex_lock(&jobs_lock)) die("could not lock mutex");
+    for (MarkJob *j = jobs; j && !job; j = j->next) {
+        lock_job(j);
+        if (!j->done) {
+            ++j->attached;
+            ++j->busy;
+            job = j;
+        }
+        unlock_job(j);
+    }
+    if (pthread_mutex_unlock(&jobs_lock)) die("could not unlock mutex");
+    if (!job) return false;
+
+    CycleContext cycx(job->cx);
+    cycx.job = job;
+    mark_loop(&cycx);
+
+    lock_job(job);
+    job->marked_bytes += cycx.marked_bytes;
+    if (!--job->attached)
+        wake_markers(job, INT_MAX);
+    unlock_job(job);
+    stats::add(stats::gc_mark_helps);
+    return true;
+}
+
+// Marks from the roots already in cycx's grey stack, with help from whoever
+// is idle.
+static void mark_in_parallel(CycleContext *cycx) {
+    MarkJob job(cycx->cx);
+    cycx->job = &job;
+
+    if (pthread_mutex_lock(&jobs_lock)) die("could not lock mutex");
+    job.next = jobs;
+    jobs = &job;
+    njobs.fetch_add(1, std::memory_order_relaxed);
+    if (pthread_mutex_unlock(&jobs_lock)) die("could not unlock mutex");
+    wake_helpers(SIZE_MAX);
+
+    mark_loop(cycx);
+
+    if (pthread_mutex_lock(&jobs_lock)) die("could not lock mutex");
+    MarkJob **p = &jobs;
+    while (*p != &job) p = &(*p)->next;
+    *p = job.next;
+    njobs.fetch_sub(1, std::memory_order_relaxed);
+    if (pthread_mutex_unlock(&jobs_lock)) die("could not unlock mutex");
+
+    // Wait for helpers to let go of the job.
+    unsigned spins = 0;
+    lock_job(&job);
+    --job.attached;
+    while (job.attached)
+        wait_on_job(&job, &spins);
+    unlock_job(&job);
+    cycx->marked_bytes += job.marked_bytes;
+    cycx->job = NULL;
+}
+
+static void collect(Context *cx, void *find_roots_data) {
+    uint64_t start = STATS_ENABLED ? now_ns() : 0;
+    Heap *heap = &cx->heap;
+    // Sweeping doesn't know about nurseries, so empty ours first.
+    if (cx->nursery_size)
+        minor_collect(cx, find_roots_data);
+    retire_region(cx);
+    // Last cycle's marks must be gone before we start.
+    finish_sweeping(heap);
+
+    CycleContext cycx(cx);
+    client::find_roots_alloc(&cycx, find_roots_data);
+    // Hold off descendants' writes until we're done marking: a write that
+    // remembered an object we had yet to reach would hide it from us.
+    if (pthread_mutex_lock(&cx->remembered_lock)) die("could not lock mutex");
+    mark_remembered(&cycx);
+    // Nobody could help a lone worker, so it might as well mark serially,
+    // without atomics.
+    if (num_helpers && heap->used_space >= GC_PARALLEL_MARK_THRESHOLD) {
+        mark_in_parallel(&cycx);
+        stats::add(stats::gc_parallel_collections);
+    } else {
+        PtrStack *grey = &cycx.grey;
+        while (grey->depth)
+            scan_object(&cycx, grey->items[--grey->depth]);
+    }
+    if (pthread_mutex_unlock(&cx->remembered_lock))
+        die("could not unlock mutex");
+
+    start_sweeping(heap);
+    sweep_large(heap);
+    size_t live = cycx.marked_bytes;
+    heap->used_space = live;
+    heap->old_space = MAX(live, INITIAL_OLD_SPACE);
+
+    stats::add(stats::gc_collections);
+    stats::add(stats::gc_bytes_marked, live);
+    count_pause(start);
+}
+
+
+/* ---------- Background collection ---------- */
+/* A context is suspended while its owner waits for stolen children. Its heap
+ * is frozen: the owner is blocked, and the children allocate into heaps of
+ * their own and only change our objects through write(), which keeps our
+ * collections informed (see "Write barrier" below). So an idle worker can
+ * collect it with the owner's roots, just as the owner would, and the cost is
+ * hidden behind the children's work instead of falling due after the join. A helper takes a
+ * context off the `suspended' list and sets its `collecting' flag in one step
+ * under suspended_lock; resume() takes the context off the list if it is still
+ * there, then sleeps on `collected' until `collecting' clears.
+ * Collecting a frozen heap twice gains nothing, so a context is only
+ * collected once per suspension.
+ */
+
+static pthread_mutex_t suspended_lock = PTHREAD_MUTEX_INITIALIZER;
+static Context *suspended = NULL;
+static std::atomic<int> nsuspended(0);
+
+static inline void lock_context(Context *cx) {
+    if (pthread_mutex_lock(&cx->lock)) die("could not lock mutex");
+}
+
+static inline void unlock_context(Context *cx) {
+    if (pthread_mutex_unlock(&cx->lock)) die("could not unlock mutex");
+}
+
+// Call with suspended_lock held.
+static void unlink_suspended(Context *cx) {
+    if (cx->prev_suspended)
+        cx->prev_suspended->next_suspended = cx->next_suspended;
+    else
+        suspended = cx->next_suspended;
+    if (cx->next_suspended)
+        cx->next_suspended->prev_suspended = cx->prev_suspended;
+    cx->next_suspended = cx->prev_suspended = NULL;
+    cx->suspended_roots = NULL;
+    nsuspended.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static inline bool background_gc_due(Context *cx) {
+    Heap *heap = &cx->heap;
+    return heap->used_space > heap->old_space * GC_BACKGROUND_RATIO;
+}
+
+void suspend(Context *cx, void *find_roots_data) {
+    assert (find_roots_data && !cx->suspended_roots);
+    if (pthread_mutex_lock(&suspended_lock)) die("could not lock mutex");
+    cx->suspended_roots = find_roots_data;
+    cx->next_suspended = suspended;
+    if (suspended)
+        suspended->prev_suspended = cx;
+    suspended = cx;
+    nsuspended.fetch_add(1, std::memory_order_relaxed);
+    // Once we unlock, a helper may take us and change our heap's sizes.
+    bool due = background_gc_due(cx);
+    if (pthread_mutex_unlock(&suspended_lock)) die("could not unlock mutex");
+    if (due)
+        wake_helpers(1);
+}
+
+void resume(Context *cx) {
+    if (pthread_mutex_lock(&suspended_lock)) die("could not lock mutex");
+    if (cx->suspended_roots)
+        unlink_suspended(cx);
+    if (pthread_mutex_unlock(&suspended_lock)) die("could not unlock mutex");
+
+    lock_context(cx);
+    while (cx->collecting) {
+        if (pthread_cond_wait(&cx->collected, &cx->lock))
+            die("could not wait on condition variable");
+    }
+    unlock_context(cx);
+}
+
+// Collects a suspended heap that is due for it, if there is one.
+static bool collect_suspended() {
+    if (!nsuspended.load(std::memory_order_relaxed))
+        return false;
+
+    Context *cx = NULL;
+    void *find_roots_data = NULL;
+    if (pthread_mutex_lock(&suspended_lock)) die("could not lock mutex");
+    for (Context *c = suspended; c; c = c->next_suspended) {
+        if (!background_gc_due(c)) continue;
+        cx = c;
+        find_roots_data = c->suspended_roots;
+        unlink_suspended(c);
+        lock_context(c);
+        c->collecting = true;
+        unlock_context(c);
+        break;
+    }
+    if (pthread_mutex_unlock(&suspended_lock)) die("could not unlock mutex");
+    if (!cx) return false;
+
+    collect(cx, find_roots_data);
+    stats::add(stats::gc_background_collections);
+
+    lock_context(cx);
+    cx->collecting = false;
+    if (pthread_cond_signal(&cx->collected))
+        die("could not signal condition variable");
+    unlock_context(cx);
+    return true;
+}
+
+bool help() {
+    return help_mark() || collect_suspended();
+}
+
+
+/* ---------- Write barrier ---------- */
+/* write() calls us before stores that might point an older object at a
+ * younger one. Within our heap that only matters if the target is in our
+ * nursery: the older object then has to be scanned by the next minor
+ * collection, like one allocated outside the nursery. Between heaps, an ancestor's object now
+ * points at one in a younger heap, which must stay put and stay alive until
+ * that heap is merged into the ancestor's. So we pin it, and add the pair to
+ * the younger heap's remembered set, which its collections mark from. Only
+ * the remembered set marks remembered objects, so the ancestor's collections
+ * never reach into heaps that aren't theirs, even ones that run during the
+ * write: the flag is set before write() publishes the pointer, and they load
+ * pointers with acquire. Merging moves the set up to the parent, dropping
+ * pairs that are now within one heap.
+ *
+ * A store into an ancestor's object also takes away the ancestor's pointer to
+ * whatever the field held, which we may have read and still be using. So that
+ * object is shaded: added to its heap's `shaded' set, which that heap's
+ * collections mark from until it has no children left. A collection that is
+ * already marking holds the set's lock, so the store waits until it is done.
+ */
+
+// The heap, of `cx' and its ancestors, that owns objects of age `age'.
+static Context *heap_of(Context *cx, age_t age) {
+    while (age < cx->fast.base_age) {
+        cx = cx->parent;
+        assert (cx);
+    }
+    return cx;
+}
+
+static inline void set_remembered(used_block_t *blk) {
+    __atomic_fetch_or(&blk->age, AGE_REMEMBERED, __ATOMIC_RELAXED);
+}
+
+static inline void clear_remembered(used_block_t *blk) {
+    __atomic_fetch_and(&blk->age, ~AGE_REMEMBERED, __ATOMIC_RELAXED);
+}
+
+// Called before a store into `field' of an object of `oheap', one of our
+// ancestors.
+static void shade_old_value(Context *cx, Context *oheap, ptr_t *field) {
+    ptr_t old = __atomic_load_n(field, __ATOMIC_RELAXED);
+    if (!old) return;
+    used_block_t *blk = block_from_ptr(old);
+    Context *heap = heap_of(
+        cx, __atomic_load_n(&blk->age, __ATOMIC_RELAXED) & ~AGE_REMEMBERED);
+    // Objects of younger heaps than oheap's are kept alive by their
+    // remembered sets anyway.
+    if (heap->fast.base_age > oheap->fast.base_age)
+        return;
+
+    if (pthread_mutex_lock(&heap->remembered_lock))
+        die("could not lock mutex");
+    ptr_stack_push(&heap->shaded, old);
+    if (pthread_mutex_unlock(&heap->remembered_lock))
+        die("could not unlock mutex");
+    stats::add(stats::gc_shaded_writes);
+}
+
+void detail::write_slow(Context *cx, ptr_t obj, ptr_t *field, ptr_t value) {
+    used_block_t *oblk = block_from_ptr(obj);
+    Context *oheap = heap_of(cx, oblk->age & ~AGE_REMEMBERED);
+    if (oheap != cx)
+        shade_old_value(cx, oheap, field);
+    if (!value) return;
+
+    used_block_t *vblk = block_from_ptr(value);
+    Context *vheap = heap_of(cx, vblk->age & ~AGE_REMEMBERED);
+
+    if (oheap == vheap) {
+        // The objects of our ancestors we can see are held while we run.
+        if (oheap == cx && cx->nursery_size && is_young(&cx->fast, value)
+            && !is_young(&cx->fast, obj))
+            ptr_stack_push(&cx->young_objects, obj);
+        return;
+    }
+    if (oheap->fast.base_age > vheap->fast.base_age)
+        return;                 // points at an ancestor's object
+
+    if (vheap == cx && is_young(&cx->fast, value))
+        pin(cx);
+    if (pthread_mutex_lock(&vheap->remembered_lock))
+        die("could not lock mutex");
+    ptr_stack_push(&vheap->remembered, obj);
+    ptr_stack_push(&vheap->remembered, value);
+    set_remembered(vblk);
+    if (pthread_mutex_unlock(&vheap->remembered_lock))
+        die("could not unlock mutex");
+    stats::add(stats::gc_remembered_writes);
+}
+
+// Moves child's remembered pairs to parent, which child has just been merged
+// into.
+static void merge_remembered(Context *parent, Context *child) {
+    PtrStack *crs = &child->remembered;
+    if (!crs->depth) return;
+
+    if (pthread_mutex_lock(&parent->remembered_lock))
+        die("could not lock mutex");
+    PtrStack *prs = &parent->remembered;
+    size_t first = prs->depth;
+    for (size_t i = 0; i < crs->depth; i += 2) {
+        ptr_t obj = crs->items[i], value = crs->items[i + 1];
+        age_t age = block_from_ptr(obj)->age & ~AGE_REMEMBERED;
+        if (age >= parent->fast.base_age) {
+            clear_remembered(block_from_ptr(value));
+        } else {
+            ptr_stack_push(prs, obj);
+            ptr_stack_push(prs, value);
+        }
+    }
+    // An object may have been in a pair we kept as well as one we dropped.
+    for (size_t i = first + 1; i < prs->depth; i += 2)
+        set_remembered(block_from_ptr(prs->items[i]));
+    if (pthread_mutex_unlock(&parent->remembered_lock))
+        die("could not unlock mutex");
+}
+
+
 /* ---------- Other context manipulation ---------- */
 Context *init() {
-    return new Context();
+    Context *cx = new Context();
+    set_nursery_size(cx, env_size("PML_NURSERY_SIZE", GC_NURSERY_SIZE));
+    use_huge_pages = env_size("PML_HUGE_PAGES", GC_HUGE_PAGES);
+    return cx;
 }
 
 void finish(Context *cx) {
-    assert (!cx->children && !cx->parent && !cx->next_child);
+    assert (!cx->children && !cx->parent && !cx->next_child
+            && !cx->prev_child);
+
+    // Free all chunks, swept or not.
+    chunk_t *lists[] = { cx->heap.chunks, cx->heap.unswept };
+    for (size_t i = 0; i < sizeof lists / sizeof *lists; ++i) {
+        chunk_t *chunk = lists[i];
+        while (chunk) {
+            chunk_t *p = chunk;
+            chunk = p->next;
+            chunk_free(p);
+        }
+    }
 
-    // Free all chunks.
-    chunk_t *chunk = cx->heap.chunks;
-    while (chunk) {
-        chunk_t *p = chunk;
-        chunk = p->next;
-        sfree(p->size, p);
+    large_object_t *lo = cx->heap.large;
+    while (lo) {
+        large_object_t *p = lo;
+        lo = p->next;
+        unmap_pages(p->map_size, p);
     }
 
     delete cx;
@@ -297,35 +1795,121 @@ void finish(Context *cx) {
 
 Context *create(Context *parent) {
     assert (parent != NULL);
-    die("unimplemented");   // FIXME
-    (void) parent;
-    return NULL;
+    Context *cx = new Context();
+    cx->parent = parent;
+
+    // Siblings may be created concurrently by different workers, while the
+    // parent's owner merges others, so its age is read under its lock.
+    if (pthread_mutex_lock(&parent->lock)) die("could not lock mutex");
+    // We can see our parent's objects, but not vice-versa.
+    if (parent->fast.age + 1 == AGE_REMEMBERED) die("heap ages exhausted");
+    cx->fast.age = cx->fast.base_age = parent->fast.age + 1;
+    cx->nursery_size = parent->nursery_size;
+    cx->next_child = parent->children;
+    if (cx->next_child)
+        cx->next_child->prev_child = cx;
+    parent->children = cx;
+    if (pthread_mutex_unlock(&parent->lock)) die("could not unlock mutex");
+
+    return cx;
 }
 
+// Takes ownership of all of child's memory and destroys it. Takes constant
+// time, however much the child allocated.
 Context *merge(
     Context *parent, void *parent_find_roots_data,
     Context *child, void *child_find_roots_data)
 {
-    die("unimplemented");   // FIXME
-    (void) parent; (void) parent_find_roots_data;
-    (void) child; (void) child_find_roots_data;
-    return NULL;
-}
+    assert (child->parent == parent && !child->children);
+    assert (!parent->suspended_roots);
+    // The child's objects may point at ours that it could see, and we won't
+    // know to update them if those move. A hold kept them put until now.
+    pin(parent);
+
+    if (pthread_mutex_lock(&parent->lock)) die("could not lock mutex");
+    if (child->prev_child)
+        child->prev_child->next_child = child->next_child;
+    else
+        parent->children = child->next_child;
+    if (child->next_child)
+        child->next_child->prev_child = child->prev_child;
+    // The child's objects become the parent's: its ages now fall in our range.
+    parent->fast.age = MAX(parent->fast.age, child->fast.age);
+    if (pthread_mutex_unlock(&parent->lock)) die("could not unlock mutex");
 
-void suspend(Context *heap) {
-    die("unimplemented");   // FIXME
-    (void) heap;
+    merge_remembered(parent, child);
+
+    retire_region(child);
+    Heap *ph = &parent->heap, *ch = &child->heap;
+    if (ch->chunks) {
+        ch->chunks_tail->next = ph->chunks;
+        ph->chunks = ch->chunks;
+        if (!ph->chunks_tail)
+            ph->chunks_tail = ch->chunks_tail;
+    }
+    if (ch->unswept) {
+        ch->unswept_tail->next = ph->unswept;
+        ph->unswept = ch->unswept;
+        if (!ph->unswept_tail)
+            ph->unswept_tail = ch->unswept_tail;
+    }
+    if (ch->large) {
+        ch->large_tail->next = ph->large;
+        ph->large = ch->large;
+        if (!ph->large_tail)
+            ph->large_tail = ch->large_tail;
+    }
+
+    for (size_t cls = 0; cls < NUM_SIZE_CLASSES; ++cls) {
+        FreeList *pl = &ph->free[cls], *cl = &ch->free[cls];
+        if (!cl->head) continue;
+        if (pl->head)
+            pl->tail->next = cl->head;
+        else
+            pl->head = cl->head;
+        pl->tail = cl->tail;
+    }
+    for (size_t i = 0; i < CLASS_BITMAP_WORDS; ++i)
+        ph->nonempty[i] |= ch->nonempty[i];
+
+    // Everything the child allocated is new as far as the parent's collector
+    // is concerned. (Adding the child's old_space too would let every child's
+    // INITIAL_OLD_SPACE pile up and put off the parent's next GC for ever.)
+    ph->used_space += ch->used_space;
+
+    HeapStats *ps = &ph->stats, *cs = &ch->stats;
+    if (cs->chunks) {
+        ps->min_chunk_free = ps->chunks
+            ? MIN(ps->min_chunk_free, cs->min_chunk_free) : cs->min_chunk_free;
+        ps->max_chunk_free = MAX(ps->max_chunk_free, cs->max_chunk_free);
+    }
+    ps->chunks += cs->chunks;
+    ps->live_bytes += cs->live_bytes;
+    ps->free_bytes += cs->free_bytes;
+    ps->free_blocks += cs->free_blocks;
+    ps->largest_free_block =
+        MAX(ps->largest_free_block, cs->largest_free_block);
+    ps->large_objects += cs->large_objects;
+    ps->large_object_bytes += cs->large_object_bytes;
+
+    delete child;
+    stats::add(stats::gc_merges);
+    return parent;
+    (void) parent_find_roots_data;
+    (void) child_find_roots_data;
 }
 
-// should never get called
-void found_roots(CycleContext *cx, size_t nroots, ptr_t *roots) {
-    die("unimplemented");   // FIXME
-    (void) cx; (void) nroots; (void) roots;
+void heap_stats(Context *cx, HeapStats *stats) {
+    // The figures are only complete once everything is swept.
+    finish_sweeping(&cx->heap);
+    *stats = cx->heap.stats;
 }
 
-void found_ptrs(CycleContext *cx, size_t nptrs, ptr_t *ptrs) {
-    die("unimplemented");   // FIXME
-    (void) cx; (void) nptrs; (void) ptrs;
+void set_nursery_size(Context *cx, size_t size) {
+    retire_region(cx);
+    lock_context(cx);           // see create()
+    cx->nursery_size = size ? MAX(size, (size_t) GC_MIN_REGION_SIZE) : 0;
+    unlock_context(cx);
 }
 
 } // namespace gc
@@ -1,7 +1,12 @@
 #ifndef GC_HPP_
 #define GC_HPP_
 
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
+
+#include "config.hpp"
+#include "util.hpp"
 
 namespace gc {
 
@@ -18,29 +23,392 @@ void finish(Context *cx);
 Context *create(Context *parent);
 Context *merge(Context *parent, void *parent_find_roots_data,
                Context *child, void *child_find_roots_data);
-void suspend(Context *heap);
+
+/* A context whose owner is about to block until its stolen children finish is
+ * suspended: nothing may allocate in it until it is resumed, and only its
+ * descendants may change its objects, through write(). Idle workers may
+ * collect a suspended heap in the meantime, using find_roots_data as its
+ * owner would. resume() waits for any such collection to finish, and must be
+ * called before the context is used again (including by merge()).
+ */
+void suspend(Context *cx, void *find_roots_data);
+void resume(Context *cx);
+
+/* A context with a nursery allocates into it, and moves surviving objects out
+ * of it when it fills up. Clients then must not keep pointers to objects
+ * across allocations except in their roots, unless the objects are pinned.
+ * Stores of new objects into old ones must go through write(), which tells
+ * the next minor collection about them.
+ * Children inherit their parent's nursery size. 0 means no nursery.
+ */
+void set_nursery_size(Context *cx, size_t size);
+
+// Guarantees that no object allocated so far in `cx' will ever move.
+inline void pin(Context *cx);
+
+/* Tasks forked from `cx' may see the objects it has allocated so far, which
+ * mustn't move until they are joined. hold() makes sure of that, and returns
+ * what to pass release() once they are joined. Holds nest. Unlike pin(), a
+ * hold costs nothing unless a minor collection happens before the release;
+ * only then are the held objects pinned.
+ */
+inline void *hold(Context *cx);
+inline void release(Context *cx, void *held);
+
+// A picture of a heap's fragmentation, taken as it was swept after its last
+// collection and updated when children are merged into it. Sizes are in bytes.
+// heap_stats() finishes any sweeping still pending.
+struct HeapStats {
+    size_t chunks;
+    size_t live_bytes;          // in chunks
+    size_t free_bytes;          // in chunks, including unusable fragments
+    size_t free_blocks;
+    size_t largest_free_block;
+    size_t min_chunk_free, max_chunk_free;
+    size_t large_objects, large_object_bytes;
+};
+
+void heap_stats(Context *cx, HeapStats *stats);
 
 
 /* ---------- Allocation ---------- */
 
+/* Where an object keeps its pointers. Objects allocated with LAYOUT_CUSTOM
+ * are scanned by calling client::find_ptrs(); the others are scanned by the
+ * collector itself, without calling out to the client.
+ *
+ * layout_prefix(k): the object's first k words are pointers, the rest aren't.
+ * layout_bitmap(bits): word i is a pointer iff bit i of `bits' is set. Only
+ * the first LAYOUT_BITMAP_WORDS words can be described this way.
+ */
+typedef uint32_t layout_t;
+
+const layout_t LAYOUT_CUSTOM = 0;
+const layout_t LAYOUT_NOPTRS = 1;
+const size_t LAYOUT_BITMAP_WORDS = 30;
+
+namespace detail {
+const layout_t LAYOUT_KIND_MASK = 3;
+const layout_t LAYOUT_PREFIX = 2;
+const layout_t LAYOUT_BITMAP = 3;
+const unsigned LAYOUT_KIND_BITS = 2;
+} // namespace detail
+
+inline layout_t layout_prefix(size_t nptrs) {
+    assert (nptrs < ((size_t) 1 << (32 - detail::LAYOUT_KIND_BITS)));
+    if (!nptrs) return LAYOUT_NOPTRS;
+    return (layout_t) nptrs << detail::LAYOUT_KIND_BITS | detail::LAYOUT_PREFIX;
+}
+
+inline layout_t layout_bitmap(uint32_t bits) {
+    assert (bits < ((uint32_t) 1 << LAYOUT_BITMAP_WORDS));
+    if (!bits) return LAYOUT_NOPTRS;
+    return bits << detail::LAYOUT_KIND_BITS | detail::LAYOUT_BITMAP;
+}
+
+// Implementation details of the inline allocation fast path. Don't touch.
+namespace detail {
+
+typedef uint32_t age_t;
+
+// Set in the age of an object that an ancestor heap's object points to (see
+// write()). Not part of the age proper.
+const age_t AGE_REMEMBERED = (age_t) 1 << 31;
+
+// Header of an allocated block.
+struct BlockHeader {
+    // `size' includes space used by header
+    size_t size;            // low bits used for metadata
+    age_t age;
+    layout_t layout;        // fits in what would be padding on 64-bit
+};
+
+// The region a Context is bump-allocating into. Always the first member of a
+// Context, so that alloc() can find it.
+struct AllocState {
+    char *cursor;
+    char *limit;
+    // If we have a nursery, objects from here up to `cursor' are in it and may
+    // move. Otherwise this is `limit', so that there are none.
+    char *young_start;
+    // Objects below this that are in the nursery are held (see hold()).
+    char *held;
+    age_t age;              // age of objects we allocate
+    age_t base_age;         // objects older than this are our ancestors'
+};
+
+const size_t BLOCK_SIZE_ALIGNMENT = MACHINE_ALIGNMENT;
+const size_t BLOCK_USED_FLAG = 1;
+const size_t HEADER_SIZE = ALIGN_UP(MACHINE_ALIGNMENT, sizeof(BlockHeader));
+// Big enough for a free block header, and leaves room for two pointers.
+const size_t MIN_BLOCK_SIZE = ALIGN_UP(
+    BLOCK_SIZE_ALIGNMENT, HEADER_SIZE + 2*sizeof(void*));
+// Blocks bigger than this skip bump allocation, so that they don't use up
+// regions, and big ones go to the large-object space.
+const size_t MAX_BUMP_ALLOC_SIZE = GC_MIN_REGION_SIZE / 4;
+
+// Size of the block needed to allocate `size' bytes.
+inline size_t block_size(size_t size) {
+    size_t real_size = (HEADER_SIZE + size + BLOCK_SIZE_ALIGNMENT - 1)
+        & ~(BLOCK_SIZE_ALIGNMENT - 1);
+    return real_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : real_size;
+}
+
+inline BlockHeader *header(ptr_t obj) {
+    return (BlockHeader*)((char*) obj - HEADER_SIZE);
+}
+
+inline bool is_young(AllocState *st, ptr_t obj) {
+    return (char*) obj >= st->young_start && (char*) obj < st->cursor;
+}
+
+// Called when the current region is too small, or the object too big for it.
+ptr_t alloc_slow(Context *cx, size_t size, void *find_roots_data,
+                 layout_t layout);
+// Bulk allocation of objects too big for the region: of `size' bytes each, or
+// of sizes[i] bytes each if `sizes' isn't NULL.
+void alloc_n_slow(Context *cx, size_t n, size_t size, const size_t *sizes,
+                  ptr_t *objs, void *find_roots_data, layout_t layout);
+// Makes the current region at least `size' bytes, collecting if need be.
+void reserve_slow(Context *cx, size_t size, void *find_roots_data);
+
+// Called by write() for stores that may need recording.
+void write_slow(Context *cx, ptr_t obj, ptr_t *field, ptr_t value);
+
+#if GC_BACKEND == GC_MARK_SWEEP
+// Makes sure the next `size' bytes of blocks can be carved without a GC.
+inline void reserve(Context *cx, size_t size, void *find_roots_data) {
+    AllocState *st = (AllocState*) cx;
+    if (__builtin_expect(size > (size_t)(st->limit - st->cursor), 0))
+        reserve_slow(cx, size, find_roots_data);
+}
+
+// Takes a block of `real_size' bytes off the front of the region, which must
+// be big enough.
+inline ptr_t carve(Context *cx, size_t real_size, layout_t layout) {
+    AllocState *st = (AllocState*) cx;
+    char *p = st->cursor;
+    st->cursor = p + real_size;
+    BlockHeader *blk = (BlockHeader*) p;
+    blk->size = real_size | BLOCK_USED_FLAG;
+    blk->age = st->age;
+    blk->layout = layout;
+    return (ptr_t)(p + HEADER_SIZE);
+}
+#elif GC_BACKEND == GC_DUMMY
+// gc-dummy.cpp never collects, so there is nothing to reserve, and objects
+// need no header.
+inline void reserve(Context *cx, size_t size, void *find_roots_data) {
+    (void) cx;
+    (void) size;
+    (void) find_roots_data;
+}
+
+inline ptr_t carve(Context *cx, size_t real_size, layout_t layout) {
+    (void) cx;
+    (void) layout;
+    return util::smalloc(real_size - HEADER_SIZE);
+}
+#else
+#error "unknown GC_BACKEND"
+#endif
+
+} // namespace detail
+
+// Pinning just ends the nursery where the cursor is. Without a nursery,
+// young_start is already at the end of the region, so this does nothing.
+// Whatever young_objects holds is left for the next minor collection, which
+// will find nothing to move through it.
+inline void pin(Context *cx) {
+#if GC_BACKEND == GC_MARK_SWEEP
+    detail::AllocState *st = (detail::AllocState*) cx;
+    st->young_start = MAX(st->young_start, st->cursor);
+#else
+    (void) cx;
+#endif
+}
+
+// A hold just remembers where the cursor was, for minor_collect() to pin up
+// to. Objects allocated before an outer hold are below an inner one too, or
+// in a region we have since given up, where nothing moves.
+inline void *hold(Context *cx) {
+#if GC_BACKEND == GC_MARK_SWEEP
+    detail::AllocState *st = (detail::AllocState*) cx;
+    char *held = st->held;
+    st->held = st->cursor;
+    return held;
+#else
+    (void) cx;
+    return NULL;
+#endif
+}
+
+inline void release(Context *cx, void *held) {
+#if GC_BACKEND == GC_MARK_SWEEP
+    ((detail::AllocState*) cx)->held = (char*) held;
+#else
+    (void) cx;
+    (void) held;
+#endif
+}
+
 /* Note that calling alloc() may cause a GC cycle. Therefore any memory
  * allocated by a previous call to alloc() must be initialized before calling
  * alloc() again.
  *
  * `find_roots_data' is passed to client::find_roots_alloc() if we do a GC
- * cycle.
+ * cycle. `layout' says where the object's pointers are (see layout_t).
  */
-ptr_t alloc(Context *cx, size_t size, void *find_roots_data);
+inline ptr_t alloc(Context *cx, size_t size, void *find_roots_data,
+                   layout_t layout = LAYOUT_CUSTOM) {
+    size_t real_size = detail::block_size(size);
+#if GC_BACKEND == GC_MARK_SWEEP
+    detail::AllocState *st = (detail::AllocState*) cx;
+    if (__builtin_expect(real_size > (size_t)(st->limit - st->cursor)
+                         || real_size > detail::MAX_BUMP_ALLOC_SIZE, 0))
+        return detail::alloc_slow(cx, size, find_roots_data, layout);
+#else
+    (void) find_roots_data;
+#endif
+    return detail::carve(cx, real_size, layout);
+}
+
+/* Bulk allocation: alloc_n() allocates `n' objects of `size' bytes each, or
+ * of sizes[i] bytes each, and stores them in objs[]. It checks for room (and
+ * may GC) once, before allocating any of them, so none of them moves before
+ * the next allocation. As with alloc(), all of them must be initialized before
+ * then.
+ */
+inline void alloc_n(Context *cx, size_t n, size_t size, ptr_t *objs,
+                    void *find_roots_data, layout_t layout = LAYOUT_CUSTOM) {
+    size_t real_size = detail::block_size(size);
+    assert (!n || real_size <= SIZE_MAX / n);
+#if GC_BACKEND == GC_MARK_SWEEP
+    if (__builtin_expect(real_size > detail::MAX_BUMP_ALLOC_SIZE, 0)) {
+        detail::alloc_n_slow(cx, n, size, NULL, objs, find_roots_data, layout);
+        return;
+    }
+#endif
+    detail::reserve(cx, n * real_size, find_roots_data);
+    for (size_t i = 0; i < n; ++i)
+        objs[i] = detail::carve(cx, real_size, layout);
+}
+
+inline void alloc_n(Context *cx, size_t n, const size_t *sizes, ptr_t *objs,
+                    void *find_roots_data, layout_t layout = LAYOUT_CUSTOM) {
+    size_t total = 0, biggest = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t real_size = detail::block_size(sizes[i]);
+        total += real_size;
+        biggest = MAX(biggest, real_size);
+    }
+#if GC_BACKEND == GC_MARK_SWEEP
+    if (__builtin_expect(biggest > detail::MAX_BUMP_ALLOC_SIZE, 0)) {
+        detail::alloc_n_slow(cx, n, 0, sizes, objs, find_roots_data, layout);
+        return;
+    }
+#endif
+    detail::reserve(cx, total, find_roots_data);
+    for (size_t i = 0; i < n; ++i)
+        objs[i] = detail::carve(cx, detail::block_size(sizes[i]), layout);
+}
+
+/* Allocation with an initializer: init(obj) (or init(i, obj) for object i of
+ * n) is called on each new object after any GC cycle the allocation causes,
+ * so it can safely read the client's roots, and in the bulk version, point
+ * objects at ones allocated before them. `init' must not allocate.
+ */
+template <typename Init>
+inline ptr_t alloc_init(Context *cx, size_t size, void *find_roots_data,
+                        layout_t layout, Init init) {
+    ptr_t obj = alloc(cx, size, find_roots_data, layout);
+    init(obj);
+    return obj;
+}
+
+template <typename Init>
+inline void alloc_n_init(Context *cx, size_t n, size_t size,
+                         void *find_roots_data, layout_t layout, Init init) {
+    size_t real_size = detail::block_size(size);
+    assert (!n || real_size <= SIZE_MAX / n);
+#if GC_BACKEND == GC_MARK_SWEEP
+    if (__builtin_expect(real_size > detail::MAX_BUMP_ALLOC_SIZE, 0)) {
+        ptr_t *objs = (ptr_t*) util::smalloc(n * sizeof(ptr_t));
+        detail::alloc_n_slow(cx, n, size, NULL, objs, find_roots_data, layout);
+        for (size_t i = 0; i < n; ++i)
+            init(i, objs[i]);
+        util::sfree(n * sizeof(ptr_t), objs);
+        return;
+    }
+#endif
+    detail::reserve(cx, n * real_size, find_roots_data);
+    for (size_t i = 0; i < n; ++i)
+        init(i, detail::carve(cx, real_size, layout));
+}
+
+
+/* ---------- Mutation ----------
+ * Stores into objects that may be older than the pointer being stored must go
+ * through write(); initializing an object's fields before allocating again
+ * needn't. This is how a task can make an object of an ancestor's, such as a
+ * shared table, point at one of its own. Its heap then keeps that object
+ * alive, and never moves it, until the task is joined and the heap merged into
+ * the ancestor's. Until then, only the task that stored the pointer and its
+ * own descendants may follow it: tasks running in parallel never see each
+ * other's objects.
+ *
+ * An ancestor's heap may be collected while we write to it, so the value is
+ * recorded before it is stored, and the store is a release: a collector that
+ * reads the new pointer sees it remembered, and leaves it alone. Whatever the
+ * field held before is recorded too, since we may still be using it, and the
+ * ancestor's collections can no longer find it there.
+ */
+inline void write(Context *cx, ptr_t obj, ptr_t *field, ptr_t value) {
+#if GC_BACKEND == GC_MARK_SWEEP
+    detail::AllocState *st = (detail::AllocState*) cx;
+    detail::age_t mask = ~detail::AGE_REMEMBERED;
+    detail::age_t obj_age = detail::header(obj)->age & mask;
+    if (obj_age < st->base_age
+        || (value && ((detail::header(value)->age & mask) > obj_age
+                      || (detail::is_young(st, value)
+                          && !detail::is_young(st, obj)))))
+        detail::write_slow(cx, obj, field, value);
+    __atomic_store_n(field, value, __ATOMIC_RELEASE);
+#else
+    (void) cx;
+    (void) obj;
+    *field = value;
+#endif
+}
 
-
 /* ---------- GC interface and client responsibilities ---------- */
 
-// Called by client::find_roots().
+// Called by client::find_roots_{merge,alloc}(), once per batch of roots.
+// `roots' must point at the client's actual root slots, which we update if we
+// move objects.
 void found_roots(CycleContext *cx, size_t nroots, ptr_t *roots);
 
-// Called by client::scan_object().
+// Called by client::find_ptrs() with the pointer fields of the object, which
+// we likewise update in place. NULL pointers are allowed.
 void found_ptrs(CycleContext *cx, size_t nptrs, ptr_t *ptrs);
 
+// Lends the calling thread to any collection that can use it, until that
+// collection no longer needs it, or else collects a suspended heap that is due
+// for it. Returns false if there was nothing to do. Meant to be called by idle
+// scheduler workers.
+bool help();
+
+// Registers `fn', which help() relies on to wake up to n idle workers when
+// there is new work for them.
+void set_wake_hook(void (*fn)(void *data, size_t n), void *data);
+
+// Tells us how many threads besides the collector's may call help(). With
+// none (the default), collections don't publish marking work.
+void set_num_helpers(size_t n);
+
+// client::find_ptrs() may be called from several threads at once, for
+// different objects. It is only called for objects allocated with
+// LAYOUT_CUSTOM.
 namespace client {
 
 void find_roots_merge(CycleContext *cx, void *find_roots_data);
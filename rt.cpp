@@ -1,81 +1,334 @@
 #include "rt.hpp"
+#include "config.hpp"
+#include "stack.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 namespace rt {
 
-Context *Context::init() {
+static bool idle_hook(void *data) {
+    (void) data;
+    return gc::help();
+}
+
+static void wake_hook(void *data, size_t n) {
+    sched::wake_idle((sched::Context*) data, n);
+}
+
+Context *Context::init(size_t nworkers) {
     Context *cx = new Context();
     cx->parent_ = NULL;
     cx->childno_ = 0;
     cx->gc_context_ = gc::init();
-    cx->sched_context_ = sched::init();
+    cx->sched_context_ = sched::init(nworkers);
+    sched::set_idle_hook(cx->sched_context_, idle_hook, NULL);
+    gc::set_wake_hook(wake_hook, cx->sched_context_);
+    gc::set_num_helpers(sched::num_workers(cx->sched_context_) - 1);
     return cx;
 }
 
 void Context::finish(Context *cx) {
     assert (cx->parent_ == NULL && cx->childno_ == 0);
-    assert (cx->roots_ == NULL);
+    assert (cx->nslots_ == 0);
 
     sched::finish(cx->sched_context_);
     gc::finish(cx->gc_context_);
     delete cx;
+
+    const char *format = getenv("PML_STATS");
+    if (format && *format && strcmp(format, "0")) {
+        stats::Snapshot s;
+        stats::snapshot(&s);
+        if (!strcmp(format, "json"))
+            stats::print_json(stderr, s);
+        else
+            stats::print_text(stderr, s);
+    }
 }
 
-ptr_t Context::alloc(size_t size) {
-    return gc::alloc(gc_context_, size, NULL);
+stats::Snapshot Context::stats() {
+    stats::Snapshot s;
+    stats::snapshot(&s);
+    return s;
 }
 
-ptr_t Context::alloc(Root *dest, size_t size) {
-    ptr_t p = this->alloc(size);
+ptr_t Context::alloc(Root *dest, size_t size, gc::layout_t layout) {
+    ptr_t p = this->alloc(size, layout);
     dest->set(p);
     return p;
 }
 
-struct TaskDesc {
+/* ---------- Forking ----------
+ * Forking pushes a small stealable frame for the work to be done later, and
+ * gets on with the rest. Only if a thief takes the frame do we make a child
+ * Context, with a heap of its own, for the work to run in. forkN() splits its
+ * tasks in halves recursively, so a thief takes a whole range of them at once,
+ * and the unstolen path needs no per-task descriptors.
+ */
+
+// The tasks of one fork. Lives on the forking task's stack.
+struct CancelGroup {
+    // Index of the first task to fail so far, or SIZE_MAX. Tasks after it are
+    // cancelled.
+    std::atomic<size_t> failed;
+    // Where the forking task itself is.
+    CancelGroup *parent;
+    size_t index;
+
+    explicit CancelGroup(Context *cx)
+        : failed(SIZE_MAX), parent(cx->group_), index(cx->index_) {}
+
+    // The index of the first failed task, or n.
+    size_t result(size_t n) {
+        return MIN(failed.load(std::memory_order_relaxed), n);
+    }
+
+  private:
+    NO_COPY(CancelGroup);
+};
+
+// Whether task `i' of `group' has been cancelled, because a task before it, or
+// before one of its forking ancestors, failed.
+static bool is_cancelled(CancelGroup *group, size_t i) {
+    for (; group; i = group->index, group = group->parent) {
+        if (group->failed.load(std::memory_order_relaxed) < i)
+            return true;
+    }
+    return false;
+}
+
+// Where a range of tasks puts its results: the forking task's roots, or, in a
+// stolen range, the bottom slots of its child's shadow stack.
+struct Results {
+    Root *roots;
+    Context *child;
+    size_t base;
+
+    explicit Results(Root *r) : roots(r), child(NULL), base(0) {}
+    Results(Context *c, size_t i) : roots(NULL), child(c), base(i) {}
+
+    void set(size_t i, ptr_t v) {
+        if (roots) roots[i].set(v);
+        else child->slots_[base + i] = v;
+    }
+
+    Results operator+(size_t i) const {
+        return roots ? Results(roots + i) : Results(child, base + i);
+    }
+};
+
+// Tasks fns[0..n) from a fork, for a thief to take.
+struct ForkFrame {
+    sched::Frame frame;
     Context *context;
-    Root *dest;
-    TaskFn taskfn;
+    CancelGroup *group;
+    TaskFn *fns;
+    size_t first;               // index of fns[0] in the group
+    size_t n;
+    Context *child;             // set by the thief, unless it was cancelled
+
+    ForkFrame(Context *cx, CancelGroup *g, TaskFn *f, size_t i, size_t count)
+        : frame(sched::TaskFn(Context::run_stolen, (void*) this)),
+          context(cx), group(g), fns(f), first(i), n(count), child(NULL)
+    {}
+};
 
-    TaskDesc() {}
-    TaskDesc(Context *c, Root *d, TaskFn f) : context(c), dest(d), taskfn(f) {}
+struct InlineCall {
+    Context *cx;
+    TaskFn fn;
+    ptr_t result;
 };
 
-bool Context::run_task(sched::Context *schedcx, bool was_stolen, void *data) {
-    TaskDesc *desc = (TaskDesc*)data;
-    Root *dest = desc->dest;
-    Context *cx = desc->context;
-    TaskFn fn = desc->taskfn;
+static void call_inline(void *arg) {
+    InlineCall *call = (InlineCall*) arg;
+    call->result = call->fn.func(call->cx, call->fn.data);
+}
+
+// Runs a task in `cx', with at least SCHED_STACK_RESERVE bytes of stack.
+static inline ptr_t run_inline(Context *cx, TaskFn fn) {
+    if (stack::has_room(SCHED_STACK_RESERVE))
+        return fn.func(cx, fn.data);
+    InlineCall call = { cx, fn, NULL };
+    stack::call(SCHED_STACK_RESERVE, call_inline, &call);
+    return call.result;
+}
 
-    if (!was_stolen) {
-        assert (schedcx == cx->sched_context_);
-        dest->set(fn.func(cx, fn.data));
-        return cx->failed_;
+// Runs task `i' of `group' here, unless a task before it has already failed.
+// (Checking our forking ancestors too would cost a walk up the groups for
+// every task; tasks that run for long should poll cancelled() instead.)
+ptr_t Context::run_task(CancelGroup *group, size_t i, TaskFn fn) {
+    if (group->failed.load(std::memory_order_relaxed) < i) {
+        stats::add(stats::rt_cancelled_tasks);
+        return NULL;
     }
-    else {
-        // Create child context.
-        assert (false);         // TODO FIXME
-        (void) schedcx;
+
+    CancelGroup *saved_group = group_;
+    size_t saved_index = index_;
+    group_ = group;
+    index_ = i;
+    ptr_t result = run_inline(this, fn);
+    group_ = saved_group;
+    index_ = saved_index;
+    return result;
+}
+
+bool Context::run_stolen(sched::Context *schedcx, bool was_stolen, void *data)
+{
+    ForkFrame *f = (ForkFrame*) data;
+    Context *cx = f->context;
+    assert (was_stolen);
+
+    // Don't bother if the results will be thrown away.
+    if (is_cancelled(f->group, f->first)) {
+        stats::add(stats::rt_cancelled_tasks, f->n);
+        return false;
     }
+
+    // Run in a child context with a heap of its own, so that we never contend
+    // with the parent (or our siblings) for allocation. The results can't go
+    // in the parent's roots until the parent merges our heap at the join;
+    // before then the parent's GC must not be able to see our objects.
+    Context *child = new Context();
+    child->parent_ = cx;
+    child->childno_ = f->first;
+    child->gc_context_ = gc::create(cx->gc_context_);
+    child->sched_context_ = schedcx;
+    child->group_ = f->group->parent;
+    child->index_ = f->group->index;
+    child->grow_slots(f->n);
+    memset(child->slots_, 0, f->n * sizeof(ptr_t));
+    child->nslots_ = f->n;
+
+    child->fork_range(f->group, f->fns, f->first, f->n, Results(child, 0));
+    assert (child->nslots_ == f->n);
+    f->child = child;
+    return false;
+    (void) was_stolen;
+}
+
+// Waits for a stolen frame. Our heap can be collected by idle workers in the
+// meantime, since nothing touches it until we return.
+void Context::join_frame(sched::Frame *frame) {
+    gc::suspend(gc_context_, (void*) this);
+    sched::join(sched_context_, frame);
+    gc::resume(gc_context_);
+}
+
+// Called once a stolen frame has been joined.
+void Context::join_stolen(ForkFrame *f, Results rets) {
+    Context *child = f->child;
+    if (!child) return;
+
+    gc_context_ = gc::merge(gc_context_, (void*) this,
+                            child->gc_context_, (void*) child);
+    for (size_t i = 0; i < f->n; ++i)
+        rets.set(i, child->slots_[i]);
+    delete child;
+}
+
+// Runs fns[0..n), which are tasks first..first+n-1 of `group'.
+void Context::fork_range(CancelGroup *group, TaskFn *fns, size_t first,
+                         size_t n, Results rets)
+{
+    if (n == 1) {
+        rets.set(0, run_task(group, first, fns[0]));
+        return;
+    }
+
+    // Tasks we fork can see our objects, so those must stay put until they
+    // are joined.
+    void *held = gc::hold(gc_context_);
+    size_t half = n / 2;
+    ForkFrame f(this, group, fns + half, first + half, n - half);
+    sched::push(sched_context_, &f.frame);
+
+    fork_range(group, fns, first, half, rets);
+
+    if (sched::pop(sched_context_, &f.frame)) {
+        fork_range(group, fns + half, first + half, n - half, rets + half);
+    } else {
+        join_frame(&f.frame);
+        join_stolen(&f, rets + half);
+    }
+    gc::release(gc_context_, held);
 }
 
 int Context::fork(Root *ret1, Root *ret2, TaskFn fn1, TaskFn fn2) {
-    TaskDesc desc1(this, ret1, fn1), desc2(this, ret2, fn2);
-    return sched::fork(sched_context_,
-                       sched::TaskFn(run_task, (void*) &desc1),
-                       sched::TaskFn(run_task, (void*) &desc2));
+    stats::add(stats::rt_forks, 1, stats::rt_tasks, 2);
+    void *held = gc::hold(gc_context_);
+    CancelGroup group(this);
+    ForkFrame f(this, &group, &fn2, 1, 1);
+    sched::push(sched_context_, &f.frame);
+
+    ret1->set(run_task(&group, 0, fn1));
+
+    if (sched::pop(sched_context_, &f.frame)) {
+        ret2->set(run_task(&group, 1, fn2));
+    } else {
+        join_frame(&f.frame);
+        join_stolen(&f, Results(ret2));
+    }
+    gc::release(gc_context_, held);
+    return (int) group.result(2);
 }
 
 int Context::forkN(size_t n, Root *rets, TaskFn *fns) {
-    sched::TaskFn schedfns[n];
-    TaskDesc descs[n];
-    for (size_t i = 0; i < n; ++i) {
-        descs[i].context = this;
-        descs[i].dest = &rets[i];
-        descs[i].taskfn = fns[i];
-        schedfns[i] = sched::TaskFn(run_task, (void*) &descs[i]);
-    }
-    return sched::forkN(sched_context_, n, schedfns);
+    if (!n) return 0;
+    stats::add(stats::rt_forks, 1, stats::rt_tasks, n);
+    CancelGroup group(this);
+    fork_range(&group, fns, 0, n, Results(rets));
+    return (int) group.result(n);
+}
+
+void Context::fail() {
+    CancelGroup *group = group_;
+    if (!group) return;         // the initial task; nothing to cancel
+    size_t failed = group->failed.load(std::memory_order_relaxed);
+    while (index_ < failed
+           && !group->failed.compare_exchange_weak(
+               failed, index_, std::memory_order_relaxed))
+        ;
+}
+
+bool Context::cancelled() {
+    return is_cancelled(group_, index_);
+}
+
+void Context::find_roots(gc::CycleContext *cx) {
+    gc::found_roots(cx, nslots_, slots_);
 }
 
-void Context::fail() { failed_ = true; }
+// Makes room for at least `n' more slots.
+void Context::grow_slots(size_t n) {
+    size_t cap = MAX(MAX(2 * slots_capacity_, nslots_ + n),
+                     (size_t) RT_SHADOW_STACK_SIZE);
+    ptr_t *slots = (ptr_t*) util::smalloc(cap * sizeof(ptr_t));
+    if (slots_) {
+        memcpy(slots, slots_, nslots_ * sizeof(ptr_t));
+        util::sfree(slots_capacity_ * sizeof(ptr_t), slots_);
+    }
+    slots_ = slots;
+    slots_capacity_ = cap;
+}
 
 } // namespace rt
+
+namespace gc {
+namespace client {
+
+// The find_roots_data we pass to gc is always the rt::Context doing the
+// allocating or merging.
+void find_roots_merge(CycleContext *cx, void *find_roots_data) {
+    ((rt::Context*) find_roots_data)->find_roots(cx);
+}
+
+void find_roots_alloc(CycleContext *cx, void *find_roots_data) {
+    ((rt::Context*) find_roots_data)->find_roots(cx);
+}
+
+} // namespace client
+} // namespace gc
@@ -7,9 +7,10 @@
 #include "util.hpp"
 #include "gc.hpp"
 #include "sched.hpp"
+#include "stats.hpp"
 
 // Clients of runtime are expected to implement
-// gc::client::find_ptrs(), but not
+// gc::client::find_ptrs() for objects allocated with gc::LAYOUT_CUSTOM, but not
 // gc::client::find_roots_{merge,alloc}().
 
 namespace rt {
@@ -17,6 +18,9 @@ namespace rt {
 struct Context;
 struct Root;
 struct Scope;
+struct CancelGroup;
+struct ForkFrame;
+struct Results;
 
 // A runtime-managed pointer. typedef for documentation purposes.
 typedef void *ptr_t;
@@ -36,61 +40,128 @@ struct TaskFn {
 struct Context {
     friend class Scope;
     friend class Root;
+    friend struct CancelGroup;
+    friend struct ForkFrame;
+    friend struct Results;
 
   private:
     Context *parent_;           // our parent task
     size_t childno_;            // which child we are of our parent
     gc::Context *gc_context_;
     sched::Context *sched_context_;
-    Root *roots_;
-    bool failed_;
+    // Our shadow stack: slots_[0..nslots_) hold our roots. Scopes and Roots
+    // push and pop slots in LIFO order, and the GC scans them in one go.
+    ptr_t *slots_;
+    size_t nslots_, slots_capacity_;
+    // Which task of which fork we are running; NULL in the initial task.
+    CancelGroup *group_;
+    size_t index_;
 
   public:
-    static Context *init();
+    // `nworkers' is passed to sched::init().
+    static Context *init(size_t nworkers = 0);
     // Should be called only on initial task, once completely finished.
     static void finish(Context *cx);
 
-    ptr_t alloc(size_t size);
-    ptr_t alloc(Root *dest, size_t size);
+    // `layout' tells the GC where the object's pointers are; objects with
+    // gc::LAYOUT_CUSTOM are scanned by gc::client::find_ptrs().
+    ptr_t alloc(size_t size, gc::layout_t layout = gc::LAYOUT_CUSTOM);
+    ptr_t alloc(Root *dest, size_t size,
+                gc::layout_t layout = gc::LAYOUT_CUSTOM);
+
+    // Bulk and initialized allocation; see gc::alloc_n() and
+    // gc::alloc_init(). The objects in objs[] are not roots, so they must be
+    // initialized (or rooted) before allocating again.
+    void alloc_n(size_t n, size_t size, ptr_t *objs,
+                 gc::layout_t layout = gc::LAYOUT_CUSTOM);
+    void alloc_n(size_t n, const size_t *sizes, ptr_t *objs,
+                 gc::layout_t layout = gc::LAYOUT_CUSTOM);
+    template <typename Init>
+    ptr_t alloc_init(size_t size, gc::layout_t layout, Init init);
+    template <typename Init>
+    void alloc_n_init(size_t n, size_t size, gc::layout_t layout, Init init);
+
+    // Stores `value' in `*field', a field of `obj'. Stores into an object
+    // that may be older than `value', such as one shared with our parent, must
+    // go through here; see gc::write().
+    void write(ptr_t obj, ptr_t *field, ptr_t value);
 
     // fork2 and forkN returns the index of the first failing subtask, or the
     // total number of subtasks forked if all succeeded.
     //
+    // Stacks grow only when tasks start, so each task has a fixed amount of
+    // stack for the calls it makes itself: a stolen task gets a stack chunk
+    // of its own (STACK_CHUNK_SIZE bytes, or $PML_STACK_CHUNK_SIZE), and one
+    // run inline at least SCHED_STACK_RESERVE bytes. Going deeper hits a
+    // guard page and crashes.
+    //
     // If subtask `i` failed, all return values after index `i` may be
     // uninitialized and should be ignored.
     int fork(Root *ret1, Root *ret2, TaskFn fn1, TaskFn fn2);
     int forkN(size_t n, Root *rets, TaskFn *fns);
 
-    // Signals that this task has failed, and its right-siblings can be
-    // cancelled. Does *not* cause exceptional control flow; the calling task
-    // function should return ASAP, and must not spawn any further tasks.
+    // Signals that this task has failed, and cancels its right-siblings. Does
+    // *not* cause exceptional control flow; the calling task function should
+    // return ASAP, and must not spawn any further tasks.
     void fail();
 
+    // Whether this task has been cancelled, because a left-sibling of it or of
+    // one of its ancestors failed. Its result will be ignored, so it should
+    // return ASAP. Cancelled tasks that haven't started yet never do, so only
+    // tasks that run for a while need to poll this.
+    bool cancelled();
+
+    // Runtime statistics so far, added up over all threads. Setting $PML_STATS
+    // prints them to stderr at finish(): as JSON if it is "json", otherwise
+    // as text.
+    stats::Snapshot stats();
+
   private:
-    static bool run_task(sched::Context *schedcx, bool was_stolen, void *data);
+    friend void gc::client::find_roots_merge(gc::CycleContext*, void*);
+    friend void gc::client::find_roots_alloc(gc::CycleContext*, void*);
+    void find_roots(gc::CycleContext *cx);
+    void grow_slots(size_t n);
+
+    ptr_t run_task(CancelGroup *group, size_t i, TaskFn fn);
+    void fork_range(CancelGroup *group, TaskFn *fns, size_t first, size_t n,
+                    Results rets);
+    static bool run_stolen(sched::Context *schedcx, bool was_stolen,
+                           void *data);
+    void join_frame(sched::Frame *frame);
+    void join_stolen(ForkFrame *f, Results rets);
 
   private:
-    Context() {}
-    ~Context() {}
+    Context() : parent_(NULL), childno_(0), gc_context_(NULL),
+                sched_context_(NULL), slots_(NULL), nslots_(0),
+                slots_capacity_(0), group_(NULL), index_(0)
+    {}
+    ~Context() {
+        if (slots_) util::sfree(slots_capacity_ * sizeof(ptr_t), slots_);
+    }
     NO_COPY(Context);
 };
 
 
+// Roots created in a scope last until it ends. A scope expecting `nroots'
+// roots can make room for them all up front.
 struct Scope {
     friend class Context;
     friend class Root;
 
   private:
     Context *context_;
-    Root *saved_;
+    size_t saved_;
 
   public:
-    explicit Scope(Context *cx)
-        : context_(cx), saved_(cx->roots_)
-    {}
+    explicit Scope(Context *cx, size_t nroots = 0)
+        : context_(cx), saved_(cx->nslots_)
+    {
+        if (cx->slots_capacity_ - cx->nslots_ < nroots)
+            cx->grow_slots(nroots);
+    }
 
     ~Scope() {
-        context_->roots_ = saved_;
+        context_->nslots_ = saved_;
     }
 
   private:
@@ -99,24 +170,28 @@ struct Scope {
 };
 
 
+// A slot in a context's shadow stack.
 struct Root {
     friend class Context;
     friend class Scope;
 
   private:
-    ptr_t value_;
-    Root *next_;
+    Context *context_;
+    size_t index_;
 
   public:
     explicit Root(const Scope &scope, ptr_t init = NULL)
-        : value_(init)
+        : context_(scope.context_)
     {
-        next_ = scope.context_->roots_;
-        scope.context_->roots_ = this;
+        Context *cx = context_;
+        if (cx->nslots_ == cx->slots_capacity_)
+            cx->grow_slots(1);
+        index_ = cx->nslots_++;
+        cx->slots_[index_] = init;
     }
 
-    ptr_t get() { return value_; }
-    void set(ptr_t v) { value_ = v; }
+    ptr_t get() { return context_->slots_[index_]; }
+    void set(ptr_t v) { context_->slots_[index_] = v; }
 
   private:
     Root();
@@ -124,6 +199,37 @@ struct Root {
 };
 
 
+inline ptr_t Context::alloc(size_t size, gc::layout_t layout) {
+    return gc::alloc(gc_context_, size, (void*) this, layout);
+}
+
+inline void Context::alloc_n(size_t n, size_t size, ptr_t *objs,
+                             gc::layout_t layout) {
+    gc::alloc_n(gc_context_, n, size, objs, (void*) this, layout);
+}
+
+inline void Context::alloc_n(size_t n, const size_t *sizes, ptr_t *objs,
+                             gc::layout_t layout) {
+    gc::alloc_n(gc_context_, n, sizes, objs, (void*) this, layout);
+}
+
+template <typename Init>
+inline ptr_t Context::alloc_init(size_t size, gc::layout_t layout,
+                                 Init init) {
+    return gc::alloc_init(gc_context_, size, (void*) this, layout, init);
+}
+
+template <typename Init>
+inline void Context::alloc_n_init(size_t n, size_t size, gc::layout_t layout,
+                                  Init init) {
+    gc::alloc_n_init(gc_context_, n, size, (void*) this, layout, init);
+}
+
+inline void Context::write(ptr_t obj, ptr_t *field, ptr_t value) {
+    gc::write(gc_context_, obj, field, value);
+}
+
+
 } // namespace rt
 
 #endif // RT_HPP_
@@ -0,0 +1,57 @@
+// Serial scheduler. A single worker runs every task as soon as it is forked,
+// so nothing is ever stolen and push() and pop() (inline in sched.hpp) do
+// nothing. Handy as a baseline, and for debugging without threads.
+
+#include "sched.hpp"
+#include "config.hpp"
+#include "util.hpp"
+
+#include <cassert>
+
+#if SCHED_BACKEND != SCHED_SERIAL
+#error "sched-serial.cpp is the serial scheduler; build sched.cpp instead"
+#endif
+
+namespace sched {
+
+using namespace util;
+
+struct Context {
+    size_t id;
+};
+
+// $PML_WORKERS and `nworkers' are ignored; there is only ever one worker.
+Context *init(size_t nworkers) {
+    (void) nworkers;
+    Context *cx = new Context();
+    cx->id = 0;
+    return cx;
+}
+
+void finish(Context *cx) {
+    assert (cx->id == 0);
+    delete cx;
+}
+
+size_t num_workers(Context *cx) { (void) cx; return 1; }
+size_t worker_id(Context *cx) { (void) cx; return 0; }
+
+// Nobody is ever idle.
+void set_idle_hook(Context *cx, bool (*fn)(void *data), void *data) {
+    (void) cx;
+    (void) fn;
+    (void) data;
+}
+
+void wake_idle(Context *cx, size_t n) {
+    (void) cx;
+    (void) n;
+}
+
+bool join(Context *cx, Frame *f) {
+    die("joined a frame that was never stolen");
+    (void) cx;
+    return f->failed;
+}
+
+} // namespace sched
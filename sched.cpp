@@ -1,24 +1,493 @@
-// Dummy scheduler implementation - serializes everything.
+// Work-stealing scheduler.
+//
+// Each worker owns a Chase-Lev deque of forked tasks that nobody has started
+// yet. fork() pushes its later branches onto the bottom of the forking
+// worker's deque and runs the first branch itself; idle workers steal from the
+// top of other workers' deques. Tasks are never suspended: a worker whose
+// forked branch was stolen waits for the thief to finish it, running other
+// stolen work in the meantime. Workers that find nothing to steal for a while
+// go to sleep (see "Parking" below).
+//
+// Stolen tasks run on stack chunks of their own (see stack.hpp), and tasks run
+// inline move onto a new chunk if the current one is nearly full.
+//
+// The deque follows "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Le et al., PPoPP 2013).
 
 #include "sched.hpp"
+#include "config.hpp"
+#include "stack.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+
+extern "C" {
+#include <pthread.h>
+#include <sched.h>
+}
+
+#if SCHED_BACKEND != SCHED_WORK_STEALING
+#error "sched.cpp is the work-stealing scheduler; build sched-serial.cpp instead"
+#endif
 
 namespace sched {
 
-Context *init() { return NULL; }
-void finish(Context *cx) { (void) cx; }
+using namespace util;
+
+/* ---------- Deques ---------- */
+// The owner's end of the deque, push() and pop(), is inline in sched.hpp.
+using detail::DequeArray;
+using detail::Deque;
+using detail::FRAME_DONE;
+
+static DequeArray *deque_array_new(size_t size, DequeArray *prev) {
+    assert (size && !(size & (size - 1)));
+    DequeArray *a = (DequeArray*) smalloc(
+        sizeof(DequeArray) + (size - 1) * sizeof(std::atomic<Frame*>));
+    a->size = size;
+    a->prev = prev;
+    return a;
+}
+
+Deque::Deque()
+    : top(0), bottom(0),
+      array(deque_array_new(SCHED_DEQUE_INITIAL_SIZE, NULL)), sleepers(NULL)
+{}
+
+Deque::~Deque() {
+    assert (top.load() == bottom.load());
+    DequeArray *a = array.load();
+    while (a) {
+        DequeArray *prev = a->prev;
+        sfree(0, a);
+        a = prev;
+    }
+}
+
+// Owner only; called by push() when the array is full.
+DequeArray *detail::deque_grow(
+    Deque *dq, DequeArray *old, int64_t top, int64_t bottom)
+{
+    DequeArray *a = deque_array_new(2 * old->size, old);
+    for (int64_t i = top; i < bottom; ++i) {
+        Frame *f = old->slots[i & (old->size - 1)]
+            .load(std::memory_order_relaxed);
+        a->slots[i & (a->size - 1)].store(f, std::memory_order_relaxed);
+    }
+    dq->array.store(a, std::memory_order_release);
+    return a;
+}
+
+// Any worker. Takes the top frame, or returns NULL if there is none or we lost
+// a race for it.
+static Frame *deque_steal(Deque *dq) {
+    int64_t t = dq->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = dq->bottom.load(std::memory_order_acquire);
+    if (t >= b) return NULL;
+
+    DequeArray *a = dq->array.load(std::memory_order_acquire);
+    Frame *f = a->slots[t & (a->size - 1)].load(std::memory_order_relaxed);
+    if (!dq->top.compare_exchange_strong(t, t + 1,
+                                         std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+        return NULL;
+    return f;
+}
+
+
+/* ---------- Workers ---------- */
+struct Pool;
+
+// One per worker; a worker's Context is only ever used by its own thread.
+struct Context {
+    Deque deque;                // must come first; see push() in sched.hpp
+    Pool *pool;
+    size_t id;
+    uint64_t rng;
+    pthread_t thread;
+    int cpu;                    // the one we're pinned to, or -1
+    size_t package;             // cpu's package, or 0
+    // Every other worker, those on our package first.
+    size_t *victims;
+    size_t nnear;
+    char pad[CACHE_LINE_SIZE];  // keep other workers' deques off our line
+
+    Context() {}
+
+  private:
+    NO_COPY(Context);
+};
+
+static_assert(offsetof(Context, deque) == 0,
+              "push() and pop() can't find Context::deque");
+
+struct Pool {
+    size_t nworkers;
+    Context *workers;
+    std::atomic<bool> done;
+    // See set_idle_hook(). idle_data is written before idle_fn.
+    std::atomic<bool (*)(void*)> idle_fn;
+    void *idle_data;
+    // See "Parking". wake_seq is the futex word; it changes on every wake-up.
+    std::atomic<int> sleepers, joiners;
+    uint32_t wake_seq;
+    // The initial thread's affinity before we pinned it, if we did.
+    bool pinned;
+    cpu_set_t initial_cpus;
 
-int fork(Context *cx, TaskFn fn1, TaskFn fn2) {
-    if (fn1.func(cx, false, fn1.data)) return 0;
-    if (fn2.func(cx, false, fn2.data)) return 1;
-    return 2;
+    explicit Pool(size_t n)
+        : nworkers(n), workers(new Context[n]), done(false), idle_fn(NULL),
+          idle_data(NULL), sleepers(0), joiners(0), wake_seq(0),
+          pinned(false)
+    {}
+
+    ~Pool() {
+        for (size_t i = 0; i < nworkers; ++i) {
+            if (workers[i].victims)
+                sfree((nworkers - 1) * sizeof(size_t), workers[i].victims);
+        }
+        delete[] workers;
+    }
+
+  private:
+    NO_COPY(Pool);
+};
+
+/* ---------- Placement ----------
+ * Workers can be pinned, each to one CPU: worker i gets the i-th CPU of
+ * $PML_CPUS, a list like "0-3,8,10-11", or if that isn't set, of those we are
+ * allowed to run on, wrapping around if there are more workers than CPUs.
+ * Pinned workers steal from workers on their own CPU package (socket) before
+ * the others, so that tasks, and the heaps they allocate, tend to stay near
+ * the memory they came from.
+ */
+
+// Parses a CPU list in the format of /sys/devices/system/cpu/online.
+static void parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *s = list;
+    for (;;) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) break;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) break;
+        }
+        if (hi >= CPU_SETSIZE) break;
+        for (long cpu = lo; cpu <= hi; ++cpu)
+            CPU_SET(cpu, set);
+        if (!*end) return;
+        if (*end != ',') break;
+        s = end + 1;
+    }
+    die("bad CPU list in $PML_CPUS: '%s'", list);
 }
 
-int forkN(Context *cx, size_t n, TaskFn *fns) {
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set))
+        die("could not pin worker to CPU %d", cpu);
+}
+
+// Chooses CPUs for the workers if they are to be pinned, and the order in
+// which each tries the others when stealing.
+static void place_workers(Pool *pool) {
+    size_t n = pool->nworkers;
+    const char *list = getenv("PML_CPUS");
+    bool pin = (list && *list)
+        || env_size("PML_PIN_WORKERS", SCHED_PIN_WORKERS);
+
+    for (size_t i = 0; i < n; ++i) {
+        pool->workers[i].cpu = -1;
+        pool->workers[i].package = 0;
+    }
+    if (pin) {
+        if (sched_getaffinity(0, sizeof pool->initial_cpus,
+                              &pool->initial_cpus))
+            die("could not get CPU affinity");
+        cpu_set_t set;
+        if (list && *list)
+            parse_cpu_list(list, &set);
+        else
+            set = pool->initial_cpus;
+
+        int cpus[CPU_SETSIZE];
+        size_t ncpus = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                cpus[ncpus++] = cpu;
+        }
+        if (!ncpus) die("no CPUs to run workers on");
+        for (size_t i = 0; i < n; ++i) {
+            pool->workers[i].cpu = cpus[i % ncpus];
+            pool->workers[i].package = cpu_package(cpus[i % ncpus]);
+        }
+        pool->pinned = true;
+    }
+
     for (size_t i = 0; i < n; ++i) {
-        if (fns[i].func(cx, false, fns[i].data))
-            return i;
+        Context *cx = &pool->workers[i];
+        cx->victims = NULL;
+        cx->nnear = 0;
+        if (n == 1) continue;
+        cx->victims = (size_t*) smalloc((n - 1) * sizeof(size_t));
+        size_t far = n - 1;
+        for (size_t j = 0; j < n; ++j) {
+            if (j == i) continue;
+            if (pool->workers[j].package == cx->package)
+                cx->victims[cx->nnear++] = j;
+            else
+                cx->victims[--far] = j;
+        }
+    }
+}
+
+
+/* ---------- Parking ----------
+ * A worker with nothing to steal spins for a while, then yields its CPU for a
+ * while, then parks: it sleeps on the pool's futex word until someone wakes it
+ * or SCHED_PARK_TIMEOUT passes. Parked workers are woken
+ *
+ *   - one by a push onto an empty deque (see push() in sched.hpp),
+ *   - one by a thief that leaves work behind in its victim's deque,
+ *   - all, if any of them is waiting on a join, when a stolen task finishes,
+ *   - as many as asked for by wake_idle(), and all by finish().
+ *
+ * Every wake-up bumps wake_seq first, and a worker only parks if wake_seq
+ * hasn't changed since before it counted itself in `sleepers' and checked for
+ * work, so a waker that sees no sleepers raced with a worker that is yet to
+ * find the work. The exceptions are push(), which loads `sleepers' without a
+ * fence to keep the fork path cheap, and wake_idle(), since parking doesn't
+ * check for work for the idle hook: a wake-up they miss costs at most one
+ * timeout.
+ */
+static void wake_parked(Pool *pool, int n) {
+    __atomic_fetch_add(&pool->wake_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&pool->wake_seq, n);
+}
+
+static bool work_visible(Pool *pool) {
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        Deque *dq = &pool->workers[i].deque;
+        if (dq->top.load(std::memory_order_relaxed)
+            < dq->bottom.load(std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+// Sleeps until woken or timed out, unless there is work or `f' (if any) is
+// done.
+static void park(Context *cx, Frame *f) {
+    Pool *pool = cx->pool;
+    uint32_t seq = __atomic_load_n(&pool->wake_seq, __ATOMIC_SEQ_CST);
+    pool->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (f) pool->joiners.fetch_add(1, std::memory_order_seq_cst);
+
+    if (!(f && f->state.load(std::memory_order_seq_cst) == FRAME_DONE)
+        && !work_visible(pool)
+        && !pool->done.load(std::memory_order_seq_cst)) {
+        futex_wait(&pool->wake_seq, seq, SCHED_PARK_TIMEOUT);
+        stats::add(stats::sched_parks);
     }
-    return n;
+
+    if (f) pool->joiners.fetch_sub(1, std::memory_order_relaxed);
+    pool->sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void detail::wake_one(Context *cx) {
+    wake_parked(cx->pool, 1);
+}
+
+
+/* ---------- Stealing ---------- */
+// A random number less than n.
+static size_t random_index(Context *cx, size_t n) {
+    // xorshift64
+    uint64_t x = cx->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cx->rng = x;
+    return (size_t)(x % n);
+}
+
+// Tries each of the n workers in victims[] once, starting from a random one.
+static Frame *steal_from(Context *cx, const size_t *victims, size_t n) {
+    if (!n) return NULL;
+    size_t start = random_index(cx, n);
+    for (size_t i = 0; i < n; ++i) {
+        size_t victim = victims[(start + i) % n];
+        Deque *dq = &cx->pool->workers[victim].deque;
+        if (Frame *f = deque_steal(dq)) {
+            // Let a sleeper have what we left behind.
+            if (cx->pool->sleepers.load(std::memory_order_relaxed)
+                && dq->top.load(std::memory_order_relaxed)
+                   < dq->bottom.load(std::memory_order_relaxed))
+                wake_parked(cx->pool, 1);
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Tries each other worker once, those on our package first.
+static Frame *steal_any(Context *cx) {
+    size_t n = cx->pool->nworkers;
+    if (n == 1) return NULL;
+
+    Frame *f = steal_from(cx, cx->victims, cx->nnear);
+    if (f) {
+        stats::add(stats::sched_steals);
+        return f;
+    }
+    f = steal_from(cx, cx->victims + cx->nnear, n - 1 - cx->nnear);
+    if (f) {
+        stats::add(stats::sched_steals);
+        stats::add(stats::sched_remote_steals);
+        return f;
+    }
+    stats::add(stats::sched_failed_steals);
+    return NULL;
+}
+
+// Called when there was nothing to steal, with the frame we are waiting for,
+// if any.
+static void idle(Context *cx, Frame *f, unsigned *spins) {
+    bool (*fn)(void*) = cx->pool->idle_fn.load(std::memory_order_acquire);
+    if (fn && fn(cx->pool->idle_data)) {
+        *spins = 0;
+    } else if (*spins < SCHED_SPIN_LIMIT) {
+        ++*spins;
+        CPU_RELAX();
+    } else if (*spins < SCHED_SPIN_LIMIT + SCHED_YIELD_LIMIT) {
+        ++*spins;
+        sched_yield();
+    } else {
+        park(cx, f);
+        *spins = 0;
+    }
+}
+
+static void run_stolen(Context *cx, Frame *f) {
+    detail::Call call = { cx, f->fn, true, false };
+    stack::call_on_new_chunk(detail::call_task, &call);
+    f->failed = call.failed;
+    f->state.store(FRAME_DONE, std::memory_order_seq_cst);
+    if (cx->pool->joiners.load(std::memory_order_seq_cst))
+        wake_parked(cx->pool, INT_MAX);
+}
+
+static void wait_for(Context *cx, Frame *f) {
+    unsigned spins = 0;
+    while (f->state.load(std::memory_order_acquire) != FRAME_DONE) {
+        Frame *g = steal_any(cx);
+        if (g) {
+            run_stolen(cx, g);
+            spins = 0;
+        } else {
+            idle(cx, f, &spins);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    Context *cx = (Context*) arg;
+    if (cx->cpu >= 0)
+        pin_to_cpu(cx->cpu);
+    unsigned spins = 0;
+    while (!cx->pool->done.load(std::memory_order_acquire)) {
+        Frame *f = steal_any(cx);
+        if (f) {
+            run_stolen(cx, f);
+            spins = 0;
+        } else {
+            idle(cx, NULL, &spins);
+        }
+    }
+    return NULL;
+}
+
+
+/* ---------- Interface ---------- */
+Context *init(size_t nworkers) {
+    if (!nworkers)
+        nworkers = MAX(env_size("PML_WORKERS", num_cpus()), 1);
+
+    Pool *pool = new Pool(nworkers);
+    for (size_t i = 0; i < nworkers; ++i) {
+        Context *cx = &pool->workers[i];
+        cx->pool = pool;
+        cx->id = i;
+        cx->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        cx->deque.sleepers = &pool->sleepers;
+    }
+    place_workers(pool);
+    if (pool->pinned)
+        pin_to_cpu(pool->workers[0].cpu);
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr)
+        || pthread_attr_setstacksize(&attr, SCHED_WORKER_STACK_SIZE))
+        die("could not set worker stack size");
+
+    pool->workers[0].thread = pthread_self();
+    for (size_t i = 1; i < nworkers; ++i) {
+        Context *cx = &pool->workers[i];
+        if (pthread_create(&cx->thread, &attr, worker_main, cx))
+            die("could not create worker thread");
+    }
+    pthread_attr_destroy(&attr);
+
+    return &pool->workers[0];
+}
+
+void finish(Context *cx) {
+    assert (cx->id == 0);
+    Pool *pool = cx->pool;
+
+    pool->done.store(true, std::memory_order_seq_cst);
+    wake_parked(pool, INT_MAX);
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        if (pthread_join(pool->workers[i].thread, NULL))
+            die("could not join worker thread");
+    }
+
+    if (pool->pinned
+        && sched_setaffinity(0, sizeof pool->initial_cpus,
+                             &pool->initial_cpus))
+        die("could not restore CPU affinity");
+    delete pool;
+}
+
+size_t num_workers(Context *cx) { return cx->pool->nworkers; }
+size_t worker_id(Context *cx) { return cx->id; }
+
+void set_idle_hook(Context *cx, bool (*fn)(void *data), void *data) {
+    cx->pool->idle_data = data;
+    cx->pool->idle_fn.store(fn, std::memory_order_release);
+}
+
+void wake_idle(Context *cx, size_t n) {
+    Pool *pool = cx->pool;
+    if (pool->sleepers.load(std::memory_order_seq_cst))
+        wake_parked(pool, (int) MIN(n, (size_t) INT_MAX));
+}
+
+bool join(Context *cx, Frame *f) {
+    wait_for(cx, f);
+    return f->failed;
 }
 
 } // namespace sched
@@ -1,14 +1,27 @@
 #ifndef SCHED_HPP_
 #define SCHED_HPP_
 
+#include <atomic>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
 
+#include "config.hpp"
+#include "stack.hpp"
+#include "util.hpp"
+
+/* The scheduler has two backends, chosen by SCHED_BACKEND (see config.hpp):
+ * sched.cpp, a pool of work-stealing workers, and sched-serial.cpp, a single
+ * worker that runs every task as soon as it is forked. Both share this
+ * interface; what's on the fork path is inline, so code built for a backend
+ * doesn't pay for the other.
+ */
 namespace sched {
 
 struct Context;
 
 struct TaskFn {
-    // returns true if task succeeded, false if it failed
+    // returns true if task failed, false if it succeeded
     bool (*func)(Context *cx, bool was_stolen, void *data);
     void *data;
 
@@ -16,12 +29,237 @@ struct TaskFn {
     TaskFn(bool (*f)(Context*, bool, void*), void *d) : func(f), data(d) {}
 };
 
-Context *init(void);
+// Starts a pool of `nworkers' workers and returns the context of the calling
+// thread, which becomes worker 0. If `nworkers' is 0, uses $PML_WORKERS, or
+// failing that the number of online CPUs.
+Context *init(size_t nworkers = 0);
 void finish(Context *cx);       // call only when finishing initial context
 
+size_t num_workers(Context *cx);
+size_t worker_id(Context *cx);
+
+// Idle workers, including ones waiting to join a stolen task, call `fn(data)'
+// between attempts to steal work. It should return true if it found something
+// useful to do.
+void set_idle_hook(Context *cx, bool (*fn)(void *data), void *data);
+
+// Workers that stay idle for a while go to sleep, and only wake up by
+// themselves now and then (see SCHED_PARK_TIMEOUT). New tasks wake them; call
+// this to wake up to n of them when there is new work for the idle hook.
+void wake_idle(Context *cx, size_t n);
+
 // returns index of failing task or 2 if no failure
-int fork(Context *cx, TaskFn fn1, TaskFn fn2);
-int forkN(Context *cx, size_t n, TaskFn *fns);
+inline int fork(Context *cx, TaskFn fn1, TaskFn fn2);
+inline int forkN(Context *cx, size_t n, TaskFn *fns);
+
+/* ---------- Frames ----------
+ * fork() and forkN() are built from these, and clients can use them directly
+ * to fork without describing every task up front: push a frame for the work
+ * to be done later, do the rest, then pop the frame and do the work yourself,
+ * or if it was stolen, join it.
+ */
+
+// A forked task that can be stolen. Lives on the stack of the worker that
+// forked it, until that worker has popped or joined it.
+struct Frame {
+    TaskFn fn;
+    bool failed;                // valid once joined
+    std::atomic<int> state;
+
+    Frame() : state(0) {}
+    explicit Frame(TaskFn f) : fn(f), state(0) {}
+};
+
+// Makes `f' stealable. Frames must be popped or joined in the reverse of the
+// order they were pushed.
+inline void push(Context *cx, Frame *f);
+// Takes back `f', the frame pushed most recently, and returns true, unless it
+// was stolen.
+inline bool pop(Context *cx, Frame *f);
+// Waits for a stolen frame to finish, running other stolen work meanwhile.
+// Returns true if the frame's task failed.
+bool join(Context *cx, Frame *f);
+
+// Runs a task inline, with at least SCHED_STACK_RESERVE bytes of stack.
+inline bool run(Context *cx, TaskFn fn);
+
+
+/* ---------- Inline implementation ---------- */
+// Implementation details of the inline fork path. Don't touch.
+namespace detail {
+
+// Frame::state. `failed' is valid once it is FRAME_DONE.
+enum { FRAME_PENDING, FRAME_DONE };
+
+struct Call {
+    Context *cx;
+    TaskFn fn;
+    bool was_stolen;
+    bool failed;
+};
+
+inline void call_task(void *arg) {
+    Call *call = (Call*) arg;
+    call->failed = call->fn.func(call->cx, call->was_stolen, call->fn.data);
+}
+
+#if SCHED_BACKEND == SCHED_WORK_STEALING
+
+// A worker's Chase-Lev deque (see sched.cpp). Frames are pushed and popped at
+// the bottom by their owner, and stolen from the top by other workers.
+struct DequeArray {
+    size_t size;                // always a power of two
+    DequeArray *prev;           // arrays we outgrew; thieves may still read them
+    std::atomic<Frame*> slots[1];
+};
+
+struct Deque {
+    std::atomic<int64_t> top, bottom;
+    std::atomic<DequeArray*> array;
+    const std::atomic<int> *sleepers; // how many workers are asleep
+
+    Deque();
+    ~Deque();
+
+  private:
+    NO_COPY(Deque);
+};
+
+DequeArray *deque_grow(Deque *dq, DequeArray *old, int64_t top,
+                       int64_t bottom);
+// Wakes a sleeping worker to steal what we just pushed.
+void wake_one(Context *cx);
+
+// A worker's deque is always the first member of its Context, so that push()
+// and pop() can find it.
+inline Deque *deque(Context *cx) { return (Deque*) cx; }
+
+#endif
+
+} // namespace detail
+
+#if SCHED_BACKEND == SCHED_WORK_STEALING
+
+inline void push(Context *cx, Frame *f) {
+    detail::Deque *dq = detail::deque(cx);
+    f->state.store(detail::FRAME_PENDING, std::memory_order_relaxed);
+
+    int64_t b = dq->bottom.load(std::memory_order_relaxed);
+    int64_t t = dq->top.load(std::memory_order_acquire);
+    detail::DequeArray *a = dq->array.load(std::memory_order_relaxed);
+    if (__builtin_expect(b - t >= (int64_t) a->size, 0))
+        a = detail::deque_grow(dq, a, t, b);
+    a->slots[b & (a->size - 1)].store(f, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    dq->bottom.store(b + 1, std::memory_order_relaxed);
+
+    // Only pushes onto an empty deque look for sleepers: while there is more
+    // to steal, thieves wake each other.
+    if (__builtin_expect(b == t, 0)
+        && dq->sleepers->load(std::memory_order_relaxed))
+        detail::wake_one(cx);
+}
+
+inline bool pop(Context *cx, Frame *f) {
+    detail::Deque *dq = detail::deque(cx);
+    int64_t b = dq->bottom.load(std::memory_order_relaxed) - 1;
+    detail::DequeArray *a = dq->array.load(std::memory_order_relaxed);
+    dq->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = dq->top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // empty: it was stolen
+        dq->bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Frame *g = a->slots[b & (a->size - 1)].load(std::memory_order_relaxed);
+    assert (g == f);
+    (void) g;
+    (void) f;
+    if (t == b) {
+        // Only one frame left; race thieves for it.
+        bool won = dq->top.compare_exchange_strong(
+            t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        dq->bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+#elif SCHED_BACKEND == SCHED_SERIAL
+
+// Nothing is ever stolen, so there's nothing to do.
+inline void push(Context *cx, Frame *f) {
+    (void) cx;
+    (void) f;
+}
+
+inline bool pop(Context *cx, Frame *f) {
+    (void) cx;
+    (void) f;
+    return true;
+}
+
+#else
+#error "unknown SCHED_BACKEND"
+#endif
+
+inline bool run(Context *cx, TaskFn fn) {
+    if (stack::has_room(SCHED_STACK_RESERVE))
+        return fn.func(cx, false, fn.data);
+    detail::Call call = { cx, fn, false, false };
+    stack::call(SCHED_STACK_RESERVE, detail::call_task, &call);
+    return call.failed;
+}
+
+inline int fork(Context *cx, TaskFn fn1, TaskFn fn2) {
+    Frame frame(fn2);
+    push(cx, &frame);
+
+    bool failed1 = run(cx, fn1);
+
+    if (pop(cx, &frame)) {
+        // Nobody stole fn2; run it ourselves, unless fn1 failed.
+        if (failed1) return 0;
+        return run(cx, fn2) ? 1 : 2;
+    }
+
+    bool failed2 = join(cx, &frame);
+    if (failed1) return 0;
+    return failed2 ? 1 : 2;
+}
+
+inline int forkN(Context *cx, size_t n, TaskFn *fns) {
+    if (!n) return 0;
+
+    // Push in reverse so that task 1 is on the bottom of our deque. Thieves
+    // take from the top, so the stolen tasks are always a suffix of fns.
+    Frame frames[n];
+    for (size_t i = n - 1; i > 0; --i) {
+        frames[i].fn = fns[i];
+        push(cx, &frames[i]);
+    }
+
+    size_t failed = run(cx, fns[0]) ? 0 : n;
+
+    size_t i;
+    for (i = 1; i < n; ++i) {
+        if (!pop(cx, &frames[i]))
+            break;              // frames i..n-1 were stolen
+        // Once a task has failed, later ones are discarded, not run.
+        if (failed == n && run(cx, fns[i]))
+            failed = i;
+    }
+
+    for (; i < n; ++i) {
+        if (join(cx, &frames[i]) && failed == n)
+            failed = i;
+    }
+
+    return (int) failed;
+}
 
 } // namespace sched
 
@@ -0,0 +1,221 @@
+// Segmented stacks.
+
+#include "stack.hpp"
+#include "config.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#include <cassert>
+#include <cstdint>
+
+extern "C" {
+#include <pthread.h>
+}
+
+namespace stack {
+
+using namespace util;
+
+/* ---------- Switching stacks ---------- */
+// void call_on_stack(void *arg, Fn fn, char *sp)
+//
+// Calls fn(arg) with the stack pointer set to `sp', which must be 16-byte
+// aligned, and restores the old stack pointer when fn returns. The frame
+// pointer keeps the old stack pointer meanwhile, and the CFI tells unwinders
+// and debuggers where to find the caller's frame.
+extern "C" void pml_call_on_stack(void *arg, Fn fn, char *sp);
+
+#if defined(__x86_64__)
+__asm__ (
+    "    .text\n"
+    "    .p2align 4\n"
+    "    .type pml_call_on_stack, @function\n"
+    "pml_call_on_stack:\n"
+    "    .cfi_startproc\n"
+    "    pushq %rbp\n"
+    "    .cfi_def_cfa_offset 16\n"
+    "    .cfi_offset %rbp, -16\n"
+    "    movq %rsp, %rbp\n"
+    "    .cfi_def_cfa_register %rbp\n"
+    "    movq %rdx, %rsp\n"
+    "    callq *%rsi\n"
+    "    movq %rbp, %rsp\n"
+    "    popq %rbp\n"
+    "    .cfi_def_cfa %rsp, 8\n"
+    "    ret\n"
+    "    .cfi_endproc\n"
+    "    .size pml_call_on_stack, .-pml_call_on_stack\n"
+);
+#define HAVE_CALL_ON_STACK 1
+#elif defined(__aarch64__)
+__asm__ (
+    "    .text\n"
+    "    .p2align 2\n"
+    "    .type pml_call_on_stack, %function\n"
+    "pml_call_on_stack:\n"
+    "    .cfi_startproc\n"
+    "    stp x29, x30, [sp, #-16]!\n"
+    "    .cfi_def_cfa_offset 16\n"
+    "    .cfi_offset x29, -16\n"
+    "    .cfi_offset x30, -8\n"
+    "    mov x29, sp\n"
+    "    .cfi_def_cfa_register x29\n"
+    "    mov sp, x2\n"
+    "    blr x1\n"
+    "    mov sp, x29\n"
+    "    .cfi_def_cfa sp, 16\n"
+    "    ldp x29, x30, [sp], #16\n"
+    "    .cfi_def_cfa_offset 0\n"
+    "    .cfi_restore x29\n"
+    "    .cfi_restore x30\n"
+    "    ret\n"
+    "    .cfi_endproc\n"
+    "    .size pml_call_on_stack, .-pml_call_on_stack\n"
+);
+#define HAVE_CALL_ON_STACK 1
+#else
+// No way to switch stacks; everything runs on the thread's own stack.
+#define HAVE_CALL_ON_STACK 0
+#endif
+
+#define STACK_ALIGNMENT 16
+
+
+/* ---------- Chunks ---------- */
+// The header sits at the top of a chunk's mapping, and the stack grows down
+// from just below it. The lowest page is a guard page.
+struct Chunk {
+    Chunk *prev;                // the chunk we switched from; NULL if the
+                                // thread's own stack
+    Chunk *next_free;           // in the thread's cache
+    size_t map_size;
+    char *lo;                   // lowest usable address
+};
+
+// This thread's current chunk, or NULL if it is on its own stack.
+static thread_local Chunk *current = NULL;
+// Lowest usable address of the thread's own stack; found on first use.
+static thread_local char *thread_stack_lo = NULL;
+
+__thread char *detail::limit = NULL;
+
+// Chunks we have finished with, kept for reuse.
+struct ChunkCache {
+    Chunk *head;
+    size_t count;
+
+    ChunkCache() : head(NULL), count(0) {}
+    ~ChunkCache() {
+        while (Chunk *c = head) {
+            head = c->next_free;
+            unmap_pages(c->map_size, c->lo - page_size());
+        }
+    }
+
+  private:
+    NO_COPY(ChunkCache);
+};
+
+static thread_local ChunkCache cache;
+
+// STACK_CHUNK_SIZE, or $PML_STACK_CHUNK_SIZE, in whole pages.
+static size_t chunk_size() {
+    static const size_t size = ALIGN_UP(page_size(), MAX(
+        env_size("PML_STACK_CHUNK_SIZE", STACK_CHUNK_SIZE), 4 * page_size()));
+    return size;
+}
+
+static char *find_thread_stack_lo() {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size, guard;
+    if (pthread_getattr_np(pthread_self(), &attr)
+        || pthread_attr_getstack(&attr, &addr, &size)
+        || pthread_attr_getguardsize(&attr, &guard))
+        die("could not find thread stack");
+    pthread_attr_destroy(&attr);
+    return (char*) addr + guard;
+}
+
+static inline char *chunk_top(Chunk *c) {
+    return (char*) ALIGN_DOWN(STACK_ALIGNMENT, (uintptr_t) c);
+}
+
+// Returns a chunk with at least `need' bytes of stack.
+static Chunk *get_chunk(size_t need) {
+    size_t usable = chunk_size() - page_size() - sizeof(Chunk)
+        - STACK_ALIGNMENT;
+    if (need <= usable && cache.head) {
+        Chunk *c = cache.head;
+        cache.head = c->next_free;
+        --cache.count;
+        return c;
+    }
+
+    size_t map_size = ALIGN_UP(page_size(), MAX(
+        chunk_size(), page_size() + need + sizeof(Chunk) + STACK_ALIGNMENT));
+    char *base = (char*) map_lazy_pages(map_size);
+    guard_pages(page_size(), base);
+    stats::add(stats::stack_chunks_mapped);
+
+    Chunk *c = (Chunk*) ALIGN_DOWN(
+        alignof(Chunk), (uintptr_t)(base + map_size - sizeof(Chunk)));
+    c->map_size = map_size;
+    c->lo = base + page_size();
+    return c;
+}
+
+static void release_chunk(Chunk *c) {
+    if (c->map_size == chunk_size()
+        && cache.count < STACK_CHUNK_CACHE_SIZE)
+    {
+        c->next_free = cache.head;
+        cache.head = c;
+        ++cache.count;
+        return;
+    }
+    unmap_pages(c->map_size, c->lo - page_size());
+}
+
+// Runs fn(arg) on a new chunk with room for `need' bytes.
+static void switch_and_call(size_t need, Fn fn, void *arg) {
+#if HAVE_CALL_ON_STACK
+    Chunk *c = get_chunk(need);
+    stats::add(stats::stack_switches);
+    c->prev = current;
+    current = c;
+    char *saved_limit = detail::limit;
+    detail::limit = c->lo;
+    pml_call_on_stack(arg, fn, chunk_top(c));
+    assert (current == c);
+    current = c->prev;
+    detail::limit = saved_limit;
+    release_chunk(c);
+#else
+    (void) need;
+    fn(arg);
+#endif
+}
+
+
+/* ---------- Interface ---------- */
+void detail::call_slow(size_t need, Fn fn, void *arg) {
+    if (!limit) {
+        // First time on this thread's own stack.
+        assert (!current);
+        if (!thread_stack_lo)
+            thread_stack_lo = find_thread_stack_lo();
+        limit = thread_stack_lo;
+        if (has_room(need)) {
+            fn(arg);
+            return;
+        }
+    }
+    switch_and_call(need, fn, arg);
+}
+
+void call_on_new_chunk(Fn fn, void *arg) {
+    switch_and_call(0, fn, arg);
+}
+
+} // namespace stack
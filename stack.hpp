@@ -0,0 +1,56 @@
+#ifndef STACK_HPP_
+#define STACK_HPP_
+
+#include <cstddef>
+
+/* ---------- Segmented stacks ----------
+ *
+ * A thread's stack is its ordinary pthread stack followed by a linked list of
+ * "stack chunks". When code asks for more stack than is left, we allocate the
+ * next chunk, switch to it, run the code and switch back on return: the glue
+ * code of ideas.org, but only at the points that ask, rather than on every
+ * call. The scheduler asks whenever it runs a task, so deep fork trees grow
+ * the stack a chunk at a time, and each stolen task starts on a fresh chunk.
+ *
+ * Each thread keeps a few released chunks for reuse, so code sitting on a
+ * chunk boundary and crossing it over and over doesn't allocate each time.
+ *
+ * Code between two switch points must fit in what it asked for; chunks have a
+ * guard page, so overrunning one crashes rather than corrupting memory. Chunks
+ * are big (STACK_CHUNK_SIZE) but mapped lazily, so that tasks can recurse
+ * deeply between switch points and still only pay for what they touch.
+ * Exceptions must not propagate out of a function run on a new chunk.
+ */
+namespace stack {
+
+typedef void (*Fn)(void *arg);
+
+namespace detail {
+// Lowest usable address of the stack we're on, or NULL if we haven't looked
+// yet.
+extern __thread char *limit;
+void call_slow(size_t need, Fn fn, void *arg);
+} // namespace detail
+
+// Whether there are at least `need' bytes of stack left.
+inline bool has_room(size_t need) {
+    char *sp = (char*) __builtin_frame_address(0);
+    char *lo = detail::limit;
+    return lo && (size_t)(sp - lo) >= need;
+}
+
+// Calls fn(arg) with at least `need' bytes of stack available, on a new chunk
+// if the current one has less left.
+inline void call(size_t need, Fn fn, void *arg) {
+    if (has_room(need))
+        fn(arg);
+    else
+        detail::call_slow(need, fn, arg);
+}
+
+// Calls fn(arg) at the top of a chunk of its own.
+void call_on_new_chunk(Fn fn, void *arg);
+
+} // namespace stack
+
+#endif // STACK_HPP_
@@ -0,0 +1,135 @@
+// Runtime statistics.
+
+#include "stats.hpp"
+#include "util.hpp"
+
+#include <new>
+
+extern "C" {
+#include <pthread.h>
+}
+
+namespace stats {
+
+using namespace util;
+
+enum Kind { KIND_SUM, KIND_MAX };
+
+static const Kind kinds[NUM_COUNTERS] = {
+#define STATS_KIND(name, kind, desc) KIND_##kind,
+    STATS_COUNTERS(STATS_KIND)
+#undef STATS_KIND
+};
+
+static const char *const names[NUM_COUNTERS] = {
+#define STATS_NAME(name, kind, desc) #name,
+    STATS_COUNTERS(STATS_NAME)
+#undef STATS_NAME
+};
+
+static const char *const descriptions[NUM_COUNTERS] = {
+#define STATS_DESCRIPTION(name, kind, desc) desc,
+    STATS_COUNTERS(STATS_DESCRIPTION)
+#undef STATS_DESCRIPTION
+};
+
+
+/* ---------- Per-thread blocks ----------
+ * Blocks are never freed. When a thread exits its block goes back to the
+ * registry with its counts, and the next new thread carries on counting in
+ * it, so the totals stay right without anyone copying counts around.
+ */
+using detail::Counters;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Counters *registry = NULL;
+
+__thread Counters *detail::local = NULL;
+
+static void lock_registry() {
+    if (pthread_mutex_lock(&registry_lock)) die("could not lock mutex");
+}
+
+static void unlock_registry() {
+    if (pthread_mutex_unlock(&registry_lock)) die("could not unlock mutex");
+}
+
+// Gives the thread's block back when it exits.
+struct Registration {
+    Counters *counters;
+
+    Registration() : counters(NULL) {}
+    ~Registration() {
+        if (!counters) return;
+        lock_registry();
+        counters->in_use = false;
+        unlock_registry();
+        detail::local = NULL;
+    }
+
+  private:
+    NO_COPY(Registration);
+};
+
+static thread_local Registration registration;
+
+Counters *detail::register_thread() {
+    lock_registry();
+    Counters *cs = registry;
+    while (cs && cs->in_use)
+        cs = cs->next;
+    if (!cs) {
+        // Whole cache lines, so that no two threads' counters share one.
+        void *p = smemalign(CACHE_LINE_SIZE,
+                            ALIGN_UP(CACHE_LINE_SIZE, sizeof(Counters)));
+        cs = new (p) Counters();
+        for (size_t i = 0; i < NUM_COUNTERS; ++i)
+            cs->values[i].store(0, std::memory_order_relaxed);
+        cs->next = registry;
+        registry = cs;
+    }
+    cs->in_use = true;
+    unlock_registry();
+
+    registration.counters = cs;
+    local = cs;
+    return cs;
+}
+
+
+/* ---------- Reporting ---------- */
+void snapshot(Snapshot *s) {
+    for (size_t i = 0; i < NUM_COUNTERS; ++i)
+        s->values[i] = 0;
+
+    lock_registry();
+    for (Counters *cs = registry; cs; cs = cs->next) {
+        for (size_t i = 0; i < NUM_COUNTERS; ++i) {
+            uint64_t v = cs->values[i].load(std::memory_order_relaxed);
+            if (kinds[i] == KIND_SUM)
+                s->values[i] += v;
+            else
+                s->values[i] = MAX(s->values[i], v);
+        }
+    }
+    unlock_registry();
+}
+
+const char *name(Counter c) { return names[c]; }
+const char *description(Counter c) { return descriptions[c]; }
+
+void print_text(FILE *out, const Snapshot &s) {
+    for (size_t i = 0; i < NUM_COUNTERS; ++i)
+        fprintf(out, "%-26s %18llu  %s\n", names[i],
+                (unsigned long long) s.values[i], descriptions[i]);
+}
+
+void print_json(FILE *out, const Snapshot &s) {
+    fputc('{', out);
+    for (size_t i = 0; i < NUM_COUNTERS; ++i)
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", names[i],
+                (unsigned long long) s.values[i]);
+    fputs("}\n", out);
+}
+
+} // namespace stats
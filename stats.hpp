@@ -0,0 +1,143 @@
+#ifndef STATS_HPP_
+#define STATS_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "config.hpp"
+
+/* ---------- Runtime statistics ----------
+ *
+ * Event counters kept by the GC, the scheduler and the runtime. Each thread
+ * counts into a cache-line-aligned block of its own, so counting is a load and
+ * a store to a line no other thread writes. snapshot() adds up the blocks of
+ * every thread, including threads that have exited.
+ *
+ * Counters must not be touched from thread_local destructors.
+ */
+namespace stats {
+
+// X(name, kind, description). `kind' says how threads' values combine: SUM
+// or MAX.
+#define STATS_COUNTERS(X)                                                   \
+    X(gc_bytes_allocated, SUM, "bytes allocated")                           \
+    X(gc_slow_allocs, SUM, "allocations that took the slow path")           \
+    X(gc_large_objects, SUM, "large objects allocated")                     \
+    X(gc_free_list_searches, SUM, "free-list searches")                     \
+    X(gc_free_list_steps, SUM, "free blocks looked at by first-fit scans")  \
+    X(gc_chunks_acquired, SUM, "chunks taken from the pool or the OS")      \
+    X(gc_chunks_released, SUM, "chunks given back")                         \
+    X(gc_slabs_mapped, SUM, "chunk slabs mapped")                           \
+    X(gc_collections, SUM, "collections")                                   \
+    X(gc_minor_collections, SUM, "nursery collections")                     \
+    X(gc_parallel_collections, SUM, "collections marked in parallel")       \
+    X(gc_background_collections, SUM, "collections of suspended heaps")     \
+    X(gc_bytes_marked, SUM, "bytes found live by collections")              \
+    X(gc_bytes_evacuated, SUM, "bytes copied out of nurseries")             \
+    X(gc_bytes_held, SUM, "bytes pinned in nurseries for forked tasks")     \
+    X(gc_pause_ns, SUM, "nanoseconds spent collecting")                     \
+    X(gc_max_pause_ns, MAX, "longest collection, in nanoseconds")           \
+    X(gc_merges, SUM, "heap merges")                                        \
+    X(gc_remembered_writes, SUM, "writes remembered by a younger heap")     \
+    X(gc_shaded_writes, SUM, "overwritten pointers an older heap kept")     \
+    X(gc_mark_helps, SUM, "times an idle worker helped mark")               \
+    X(gc_mark_sleeps, SUM, "times a marking thread went to sleep")          \
+    X(sched_steals, SUM, "tasks stolen")                                    \
+    X(sched_failed_steals, SUM, "rounds of stealing that found nothing")    \
+    X(sched_remote_steals, SUM, "tasks stolen from another CPU package")    \
+    X(sched_parks, SUM, "times an idle worker went to sleep")               \
+    X(rt_forks, SUM, "forks")                                               \
+    X(rt_tasks, SUM, "tasks forked")                                        \
+    X(rt_cancelled_tasks, SUM, "tasks skipped because they were cancelled") \
+    X(stack_switches, SUM, "switches to a new stack chunk")                 \
+    X(stack_chunks_mapped, SUM, "stack chunks mapped")
+
+enum Counter {
+#define STATS_ENUM(name, kind, desc) name,
+    STATS_COUNTERS(STATS_ENUM)
+#undef STATS_ENUM
+    NUM_COUNTERS
+};
+
+// The values of all counters at some moment.
+struct Snapshot {
+    uint64_t values[NUM_COUNTERS];
+
+    uint64_t operator[](Counter c) const { return values[c]; }
+};
+
+namespace detail {
+
+// Only the owning thread writes to its block; other threads just read it.
+struct Counters {
+    std::atomic<uint64_t> values[NUM_COUNTERS];
+    Counters *next;             // all blocks ever made
+    bool in_use;                // owned by a live thread
+};
+
+extern __thread Counters *local;
+Counters *register_thread();
+
+inline std::atomic<uint64_t> *counter(Counter c) {
+    Counters *cs = local;
+    if (__builtin_expect(!cs, 0))
+        cs = register_thread();
+    return &cs->values[c];
+}
+
+} // namespace detail
+
+inline void add(Counter c, uint64_t n = 1) {
+#if STATS_ENABLED
+    std::atomic<uint64_t> *v = detail::counter(c);
+    v->store(v->load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+#else
+    (void) c;
+    (void) n;
+#endif
+}
+
+// Adds to two counters at once, looking up the thread's block only once.
+inline void add(Counter c1, uint64_t n1, Counter c2, uint64_t n2) {
+#if STATS_ENABLED
+    std::atomic<uint64_t> *v1 = detail::counter(c1);
+    std::atomic<uint64_t> *v2 = v1 + (c2 - c1);
+    v1->store(v1->load(std::memory_order_relaxed) + n1,
+              std::memory_order_relaxed);
+    v2->store(v2->load(std::memory_order_relaxed) + n2,
+              std::memory_order_relaxed);
+#else
+    (void) c1;
+    (void) n1;
+    (void) c2;
+    (void) n2;
+#endif
+}
+
+// For MAX counters.
+inline void record(Counter c, uint64_t n) {
+#if STATS_ENABLED
+    std::atomic<uint64_t> *v = detail::counter(c);
+    if (n > v->load(std::memory_order_relaxed))
+        v->store(n, std::memory_order_relaxed);
+#else
+    (void) c;
+    (void) n;
+#endif
+}
+
+void snapshot(Snapshot *s);
+
+const char *name(Counter c);
+const char *description(Counter c);
+
+// One counter per line, or a single JSON object keyed by counter name.
+void print_text(FILE *out, const Snapshot &s);
+void print_json(FILE *out, const Snapshot &s);
+
+} // namespace stats
+
+#endif // STATS_HPP_
@@ -0,0 +1,602 @@
+// Self-checking tests of the runtime, for what the benchmarks don't cover.
+// Dies with a message at the first failure. `make test' runs it with one
+// worker and with several, with and without a nursery.
+
+#include "../rt.hpp"
+#include "../util.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+extern "C" {
+#include <sched.h>
+}
+
+using util::die;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond))                                                    \
+            die("%s:%d: check failed: %s", __FILE__, __LINE__, #cond);  \
+    } while (0)
+
+static size_t nworkers;
+static size_t nursery_size;
+
+// Whether counter `c' has gone up since it was `before'. Always true if
+// statistics are compiled out.
+static bool counted(rt::Context *cx, stats::Counter c, uint64_t before) {
+    return !STATS_ENABLED || cx->stats()[c] > before;
+}
+
+
+/* ---------- Objects ---------- */
+// List cells, with the pointer in the first word.
+struct Cell {
+    rt::ptr_t next;
+    long value;
+};
+
+static const gc::layout_t CELL_LAYOUT = gc::layout_prefix(1);
+
+// Pairs, with a word between the pointers. Allocated either with
+// PAIR_LAYOUT or with gc::LAYOUT_CUSTOM, for find_ptrs() below.
+struct Pair {
+    rt::ptr_t left;
+    long tag;
+    rt::ptr_t right;
+};
+
+static const gc::layout_t PAIR_LAYOUT = gc::layout_bitmap(1 | 4);
+
+// A list of `len' cells, holding first, first + 1, ... from the head.
+static rt::ptr_t make_list(rt::Context *cx, long first, size_t len,
+                           gc::layout_t layout = CELL_LAYOUT) {
+    rt::Scope scope(cx, 1);
+    rt::Root head(scope);
+    for (size_t i = len; i-- > 0; ) {
+        Cell *c = (Cell*) cx->alloc(sizeof(Cell), layout);
+        c->next = head.get();
+        c->value = first + (long) i;
+        head.set(c);
+    }
+    return head.get();
+}
+
+// `n' roots in a row, for forkN().
+struct RootArray {
+    rt::Root *roots;
+    size_t n;
+
+    RootArray(const rt::Scope &scope, size_t count)
+        : roots((rt::Root*) util::smalloc(count * sizeof(rt::Root))),
+          n(count)
+    {
+        for (size_t i = 0; i < n; ++i)
+            new (&roots[i]) rt::Root(scope);
+    }
+
+    ~RootArray() { util::sfree(n * sizeof(rt::Root), roots); }
+
+  private:
+    NO_COPY(RootArray);
+};
+
+static void check_list(rt::ptr_t list, long first, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        CHECK(list != NULL);
+        Cell *c = (Cell*) list;
+        CHECK(c->value == first + (long) i);
+        list = c->next;
+    }
+    CHECK(list == NULL);
+}
+
+static rt::ptr_t make_pair(rt::Context *cx, long tag, rt::Root *left,
+                           rt::Root *right, gc::layout_t layout) {
+    Pair *p = (Pair*) cx->alloc(sizeof(Pair), layout);
+    p->left = left->get();
+    p->tag = tag;
+    p->right = right->get();
+    return p;
+}
+
+// Allocates and drops about `cells' cells, which is enough to collect a small
+// heap several times over.
+static void churn(rt::Context *cx, size_t cells) {
+    for (size_t i = 0; i < cells; i += 100)
+        make_list(cx, 0, 100);
+}
+
+
+/* ---------- Forking ---------- */
+// Runs fn1 and fn2 in parallel, making sure that fn2 is stolen if there is
+// another worker to steal it: fn1 doesn't start until fn2 has.
+struct StolenFork {
+    rt::TaskFn fn1, fn2;
+    std::atomic<bool> started;
+};
+
+static rt::ptr_t run_after_steal(rt::Context *cx, void *data) {
+    StolenFork *f = (StolenFork*) data;
+    if (nworkers > 1) {
+        while (!f->started.load(std::memory_order_acquire))
+            sched_yield();
+    }
+    return f->fn1.func(cx, f->fn1.data);
+}
+
+static rt::ptr_t run_stolen(rt::Context *cx, void *data) {
+    StolenFork *f = (StolenFork*) data;
+    f->started.store(true, std::memory_order_release);
+    return f->fn2.func(cx, f->fn2.data);
+}
+
+static int fork_stolen(rt::Context *cx, rt::Root *ret1, rt::Root *ret2,
+                       rt::TaskFn fn1, rt::TaskFn fn2) {
+    StolenFork f;
+    f.fn1 = fn1;
+    f.fn2 = fn2;
+    f.started.store(false, std::memory_order_relaxed);
+    uint64_t steals = cx->stats()[stats::sched_steals];
+    int result = cx->fork(ret1, ret2, rt::TaskFn(run_after_steal, &f),
+                          rt::TaskFn(run_stolen, &f));
+    if (nworkers > 1)
+        CHECK(counted(cx, stats::sched_steals, steals));
+    return result;
+}
+
+static rt::ptr_t nothing(rt::Context *cx, void *data) {
+    (void) cx;
+    (void) data;
+    return NULL;
+}
+
+
+/* ---------- Tests ---------- */
+static void test_layouts(rt::Context *cx) {
+    uint64_t collections = cx->stats()[stats::gc_collections];
+    rt::Scope scope(cx, 3);
+    rt::Root a(scope, make_list(cx, 100, 10));
+    rt::Root b(scope, make_list(cx, 200, 10, gc::layout_bitmap(1)));
+    rt::Root p(scope, make_pair(cx, 1, &a, &b, gc::LAYOUT_CUSTOM));
+    a.set(p.get());
+    p.set(make_pair(cx, 2, &a, &b, PAIR_LAYOUT));
+    a.set(NULL);
+    b.set(NULL);
+
+    churn(cx, 100000);
+    CHECK(counted(cx, stats::gc_collections, collections));
+
+    Pair *outer = (Pair*) p.get();
+    CHECK(outer->tag == 2);
+    check_list(outer->right, 200, 10);
+    Pair *inner = (Pair*) outer->left;
+    CHECK(inner->tag == 1);
+    check_list(inner->left, 100, 10);
+    CHECK(inner->right == outer->right);
+}
+
+static void test_bulk(rt::Context *cx) {
+    const size_t n = 64;
+    rt::Scope scope(cx, 6);
+
+    // Every object is usable until we allocate again, so they can be linked
+    // up afterwards.
+    rt::ptr_t objs[n];
+    cx->alloc_n(n, sizeof(Cell), objs, CELL_LAYOUT);
+    for (size_t i = 0; i < n; ++i) {
+        Cell *c = (Cell*) objs[i];
+        c->value = (long) i;
+        c->next = i + 1 < n ? objs[i + 1] : NULL;
+    }
+    rt::Root list(scope, objs[0]);
+
+    // Mixed sizes, some of them big enough for the large-object space.
+    uint64_t large = cx->stats()[stats::gc_large_objects];
+    const size_t sizes[] = { sizeof(Cell), 100 * 1024, 3000, sizeof(Cell) };
+    rt::ptr_t mixed[4];
+    cx->alloc_n(4, sizes, mixed, CELL_LAYOUT);
+    for (size_t i = 0; i < 4; ++i) {
+        Cell *c = (Cell*) mixed[i];
+        c->next = i ? mixed[i - 1] : NULL;
+        memset((char*) mixed[i] + sizeof(rt::ptr_t), (int) i + 1,
+               sizes[i] - sizeof(rt::ptr_t));
+    }
+    rt::Root mixed_last(scope, mixed[3]);
+    CHECK(counted(cx, stats::gc_large_objects, large));
+
+    // Initializers run after any collection, so they may read roots.
+    rt::Root head(scope, cx->alloc_init(
+        sizeof(Cell), CELL_LAYOUT, [&](rt::ptr_t obj) {
+            Cell *c = (Cell*) obj;
+            c->next = list.get();
+            c->value = -1;
+        }));
+
+    // ...and point objects at ones allocated before them.
+    rt::ptr_t prev = NULL;
+    cx->alloc_n_init(n, sizeof(Cell), CELL_LAYOUT,
+                     [&](size_t i, rt::ptr_t obj) {
+                         Cell *c = (Cell*) obj;
+                         c->next = prev;
+                         c->value = (long)(n - 1 - i);
+                         prev = obj;
+                     });
+    rt::Root chain(scope, prev);
+
+    large = cx->stats()[stats::gc_large_objects];
+    rt::ptr_t bigs[2];
+    cx->alloc_n_init(2, 80 * 1024, gc::LAYOUT_NOPTRS,
+                     [&](size_t i, rt::ptr_t obj) {
+                         memset(obj, 0x50 + (int) i, 80 * 1024);
+                         bigs[i] = obj;
+                     });
+    rt::Root big0(scope, bigs[0]), big1(scope, bigs[1]);
+    CHECK(counted(cx, stats::gc_large_objects, large));
+
+    churn(cx, 100000);
+
+    check_list(list.get(), 0, n);
+    Cell *h = (Cell*) head.get();
+    CHECK(h->value == -1 && h->next == list.get());
+    check_list(chain.get(), 0, n);
+
+    rt::ptr_t m = mixed_last.get();
+    for (size_t i = 4; i-- > 0; ) {
+        const unsigned char *bytes = (const unsigned char*) m;
+        for (size_t j = sizeof(rt::ptr_t); j < sizes[i]; ++j)
+            CHECK(bytes[j] == i + 1);
+        m = ((Cell*) m)->next;
+    }
+    CHECK(m == NULL);
+
+    rt::ptr_t b[2] = { big0.get(), big1.get() };
+    for (size_t i = 0; i < 2; ++i) {
+        const unsigned char *bytes = (const unsigned char*) b[i];
+        for (size_t j = 0; j < 80 * 1024; j += 4096)
+            CHECK(bytes[j] == 0x50 + i);
+    }
+}
+
+static void test_large_objects(rt::Context *cx) {
+    const size_t nptrs = 16 * 1024;
+    uint64_t large = cx->stats()[stats::gc_large_objects];
+    rt::Scope scope(cx, 2);
+    rt::Root table(scope, cx->alloc(nptrs * sizeof(rt::ptr_t),
+                                    gc::layout_prefix(nptrs)));
+    memset(table.get(), 0, nptrs * sizeof(rt::ptr_t));
+    for (size_t i = 0; i < nptrs; i += 1024) {
+        rt::ptr_t list = make_list(cx, (long) i, 5);
+        cx->write(table.get(), &((rt::ptr_t*) table.get())[i], list);
+    }
+    rt::Root bytes(scope, cx->alloc(1024 * 1024, gc::LAYOUT_NOPTRS));
+    memset(bytes.get(), 0x77, 1024 * 1024);
+    CHECK(counted(cx, stats::gc_large_objects, large + 1));
+
+    // Some garbage for the sweep to unmap.
+    for (size_t i = 0; i < 20; ++i)
+        cx->alloc(256 * 1024, gc::LAYOUT_NOPTRS);
+    churn(cx, 100000);
+
+    rt::ptr_t *slots = (rt::ptr_t*) table.get();
+    for (size_t i = 0; i < nptrs; ++i) {
+        if (i % 1024)
+            CHECK(slots[i] == NULL);
+        else
+            check_list(slots[i], (long) i, 5);
+    }
+    const unsigned char *b = (const unsigned char*) bytes.get();
+    for (size_t i = 0; i < 1024 * 1024; i += 1000)
+        CHECK(b[i] == 0x77);
+}
+
+static void test_nursery(rt::Context *cx) {
+    uint64_t minors = cx->stats()[stats::gc_minor_collections];
+    uint64_t evacuated = cx->stats()[stats::gc_bytes_evacuated];
+    rt::Scope scope(cx, 2);
+    rt::Root old(scope, make_list(cx, 1, 3));
+    churn(cx, 10000);
+
+    // An old object pointed at young ones, which must then survive minor
+    // collections through it.
+    rt::Root young(scope);
+    for (int i = 0; i < 100; ++i) {
+        young.set(make_list(cx, 10, 20));
+        cx->write(old.get(), &((Cell*) old.get())->next, young.get());
+        young.set(NULL);
+        churn(cx, 300);
+    }
+    Cell *c = (Cell*) old.get();
+    CHECK(c->value == 1);
+    check_list(c->next, 10, 20);
+
+    if (nursery_size) {
+        CHECK(counted(cx, stats::gc_minor_collections, minors));
+        CHECK(counted(cx, stats::gc_bytes_evacuated, evacuated));
+    }
+}
+
+// A task's data points at a young list of its forking task's, which the other
+// task's minor collections must leave where it is, whether the task is stolen
+// or runs after it.
+static rt::ptr_t churn_task(rt::Context *cx, void *data) {
+    (void) data;
+    churn(cx, 20000);
+    return NULL;
+}
+
+static rt::ptr_t read_task(rt::Context *cx, void *data) {
+    (void) cx;
+    check_list((rt::ptr_t) data, 30, 20);
+    return NULL;
+}
+
+static void test_forked_young(rt::Context *cx) {
+    uint64_t held = cx->stats()[stats::gc_bytes_held];
+    rt::Scope scope(cx, 3);
+    rt::Root list(scope, make_list(cx, 30, 20));
+    rt::Root a(scope), b(scope);
+    cx->fork(&a, &b, rt::TaskFn(churn_task, NULL),
+             rt::TaskFn(read_task, list.get()));
+    // Joined, the list may move again.
+    churn(cx, 20000);
+    check_list(list.get(), 30, 20);
+    if (nursery_size)
+        CHECK(counted(cx, stats::gc_bytes_held, held));
+}
+
+// Tasks store lists of their own in a table of their forking ancestor's.
+struct BarrierArg {
+    rt::ptr_t table;            // of the initial task; never moves
+    size_t slot;
+    int depth;
+};
+
+static const size_t BARRIER_FANOUT = 8;
+static const size_t BARRIER_SLOTS = 1 + 8 + 8 * 8;
+
+static rt::ptr_t barrier_task(rt::Context *cx, void *data) {
+    BarrierArg *arg = (BarrierArg*) data;
+    rt::ptr_t *slots = (rt::ptr_t*) arg->table;
+
+    churn(cx, 5000);
+    cx->write(arg->table, &slots[arg->slot],
+              make_list(cx, (long) arg->slot * 100, 30));
+    // Our collections must keep the list alive, and leave it where it is.
+    churn(cx, 5000);
+
+    if (arg->depth < 2) {
+        BarrierArg args[BARRIER_FANOUT];
+        rt::TaskFn fns[BARRIER_FANOUT];
+        for (size_t i = 0; i < BARRIER_FANOUT; ++i) {
+            args[i].table = arg->table;
+            args[i].slot = arg->slot * BARRIER_FANOUT + i + 1;
+            args[i].depth = arg->depth + 1;
+            fns[i] = rt::TaskFn(barrier_task, &args[i]);
+        }
+        rt::Scope scope(cx, BARRIER_FANOUT);
+        RootArray rets(scope, BARRIER_FANOUT);
+        CHECK(cx->forkN(BARRIER_FANOUT, rets.roots, fns)
+              == (int) BARRIER_FANOUT);
+    }
+    return NULL;
+}
+
+// Collects the forking task's heap while a stolen task writes into it.
+static rt::ptr_t collect_meanwhile(rt::Context *cx, void *data) {
+    (void) data;
+    churn(cx, 200000);
+    return NULL;
+}
+
+static rt::ptr_t write_meanwhile(rt::Context *cx, void *data) {
+    BarrierArg *arg = (BarrierArg*) data;
+    rt::ptr_t *slots = (rt::ptr_t*) arg->table;
+    for (int i = 0; i < 200; ++i) {
+        cx->write(arg->table, &slots[arg->slot],
+                  make_list(cx, (long) arg->slot * 100, 30));
+        churn(cx, 1000);
+    }
+    return NULL;
+}
+
+static void test_write_barrier(rt::Context *cx) {
+    uint64_t remembered = cx->stats()[stats::gc_remembered_writes];
+    rt::Scope scope(cx, 3);
+    rt::Root table(scope, cx->alloc(BARRIER_SLOTS * sizeof(rt::ptr_t),
+                                    gc::layout_prefix(BARRIER_SLOTS)));
+    memset(table.get(), 0, BARRIER_SLOTS * sizeof(rt::ptr_t));
+    // Old enough that the tasks' heaps are younger than it.
+    churn(cx, 10000);
+
+    BarrierArg arg = { table.get(), 0, 0 };
+    barrier_task(cx, &arg);
+    churn(cx, 100000);
+    rt::ptr_t *slots = (rt::ptr_t*) table.get();
+    for (size_t i = 0; i < BARRIER_SLOTS; ++i)
+        check_list(slots[i], (long) i * 100, 30);
+
+    rt::Root a(scope), b(scope);
+    BarrierArg racer = { table.get(), 0, 0 };
+    fork_stolen(cx, &a, &b, rt::TaskFn(collect_meanwhile, NULL),
+                rt::TaskFn(write_meanwhile, &racer));
+    churn(cx, 100000);
+    slots = (rt::ptr_t*) table.get();
+    for (size_t i = 0; i < BARRIER_SLOTS; ++i)
+        check_list(slots[i], (long) i * 100, 30);
+    if (nworkers > 1)
+        CHECK(counted(cx, stats::gc_remembered_writes, remembered));
+}
+
+// A stolen task takes a list out of a table of its forking task's, and
+// overwrites the slot while idle workers collect the forking task's heap
+// during the join. The list must survive: the stolen task still has it.
+struct SnatchArg {
+    rt::ptr_t table;            // of the initial task; never moves
+    long first;
+    uint64_t background;        // background collections so far
+};
+
+static rt::ptr_t snatch_task(rt::Context *cx, void *data) {
+    SnatchArg *arg = (SnatchArg*) data;
+    rt::ptr_t *slots = (rt::ptr_t*) arg->table;
+    rt::Scope scope(cx, 1);
+    rt::Root list(scope, slots[0]);
+    cx->write(arg->table, &slots[0], make_list(cx, 0, 5));
+
+    uint64_t deadline = util::now_ns() + 20 * 1000 * 1000;
+    while (nworkers > 1 && util::now_ns() < deadline
+           && !counted(cx, stats::gc_background_collections,
+                       arg->background))
+        sched_yield();
+    check_list(list.get(), arg->first, 10);
+    return list.get();
+}
+
+// Leaves some garbage in the forking task's heap, so that it comes due for
+// a collection at some point.
+static rt::ptr_t garbage_task(rt::Context *cx, void *data) {
+    (void) data;
+    churn(cx, 1000);
+    return NULL;
+}
+
+static void test_overwritten_field(rt::Context *cx) {
+    uint64_t background = cx->stats()[stats::gc_background_collections];
+    rt::Scope scope(cx, 3);
+    rt::Root table(scope, cx->alloc(sizeof(rt::ptr_t), gc::layout_prefix(1)));
+    *(rt::ptr_t*) table.get() = NULL;
+    churn(cx, 10000);
+
+    rt::Root a(scope), b(scope);
+    for (long i = 0; i < 32; ++i) {
+        rt::ptr_t *slots = (rt::ptr_t*) table.get();
+        cx->write(table.get(), &slots[0], make_list(cx, i, 10));
+        SnatchArg arg = {
+            table.get(), i, cx->stats()[stats::gc_background_collections]
+        };
+        fork_stolen(cx, &a, &b, rt::TaskFn(garbage_task, NULL),
+                    rt::TaskFn(snatch_task, &arg));
+        churn(cx, 5000);
+        check_list(b.get(), i, 10);
+    }
+    if (nworkers > 1)
+        CHECK(counted(cx, stats::gc_background_collections, background));
+}
+
+static std::atomic<int> polls(0);
+
+static rt::ptr_t fail_task(rt::Context *cx, void *data) {
+    (void) data;
+    cx->fail();
+    return NULL;
+}
+
+static rt::ptr_t poll_task(rt::Context *cx, void *data) {
+    (void) data;
+    while (!cx->cancelled())
+        sched_yield();
+    polls.fetch_add(1, std::memory_order_relaxed);
+    return make_list(cx, 0, 1);
+}
+
+static rt::ptr_t fork_polls(rt::Context *cx, void *data) {
+    (void) data;
+    rt::Scope scope(cx, 2);
+    rt::Root a(scope), b(scope);
+    cx->fork(&a, &b, rt::TaskFn(poll_task, NULL),
+             rt::TaskFn(poll_task, NULL));
+    return NULL;
+}
+
+static void test_cancellation(rt::Context *cx) {
+    rt::Scope scope(cx, 4);
+    rt::Root a(scope), b(scope);
+
+    CHECK(cx->fork(&a, &b, rt::TaskFn(nothing, NULL),
+                   rt::TaskFn(fail_task, NULL)) == 1);
+    CHECK(cx->fork(&a, &b, rt::TaskFn(fail_task, NULL),
+                   rt::TaskFn(poll_task, NULL)) == 0);
+
+    // Later tasks are either skipped or see that they are cancelled.
+    RootArray rets(scope, 4);
+    rt::TaskFn fns[4] = {
+        rt::TaskFn(nothing, NULL), rt::TaskFn(fail_task, NULL),
+        rt::TaskFn(poll_task, NULL), rt::TaskFn(fork_polls, NULL),
+    };
+    CHECK(cx->forkN(4, rets.roots, fns) == 1);
+
+    // So do the tasks of a fork inside a stolen task, once an earlier task of
+    // the outer fork fails.
+    polls.store(0, std::memory_order_relaxed);
+    CHECK(fork_stolen(cx, &a, &b, rt::TaskFn(fail_task, NULL),
+                      rt::TaskFn(fork_polls, NULL)) == 0);
+    // The second poller may be stolen after the failure, and then skipped.
+    if (nworkers > 1) {
+        int n = polls.load(std::memory_order_relaxed);
+        CHECK(n >= 1 && n <= 2);
+    }
+}
+
+// Uses about depth KiB of stack.
+static long __attribute__((noinline)) recurse(long depth) {
+    volatile char frame[1024];
+    memset((char*) frame, (int) depth, sizeof frame);
+    if (!depth) return 0;
+    return recurse(depth - 1) + frame[depth % sizeof frame];
+}
+
+static rt::ptr_t deep_task(rt::Context *cx, void *data) {
+    long depth = (long)(intptr_t) data;
+    long *result = (long*) cx->alloc(sizeof(long), gc::LAYOUT_NOPTRS);
+    *result = recurse(depth);
+    return result;
+}
+
+static void test_deep_recursion(rt::Context *cx) {
+    const long depth = 2048;
+    long expected = recurse(depth);
+    rt::Scope scope(cx, 2);
+    rt::Root a(scope), b(scope);
+    fork_stolen(cx, &a, &b, rt::TaskFn(deep_task, (void*)(intptr_t) depth),
+                rt::TaskFn(deep_task, (void*)(intptr_t) depth));
+    CHECK(*(long*) a.get() == expected);
+    CHECK(*(long*) b.get() == expected);
+}
+
+
+int main() {
+    rt::Context *cx = rt::Context::init();
+    nworkers = MAX(util::env_size("PML_WORKERS", util::num_cpus()), 1);
+    nursery_size = util::env_size("PML_NURSERY_SIZE", GC_NURSERY_SIZE);
+
+    test_layouts(cx);
+    test_bulk(cx);
+    test_large_objects(cx);
+    test_nursery(cx);
+    test_forked_young(cx);
+    test_write_barrier(cx);
+    test_overwritten_field(cx);
+    test_cancellation(cx);
+    test_deep_recursion(cx);
+
+    rt::Context::finish(cx);
+    printf("rt-test workers=%zu nursery=%zu: ok\n", nworkers, nursery_size);
+    return 0;
+}
+
+namespace gc {
+namespace client {
+
+// Only Pairs have custom layouts.
+void find_ptrs(CycleContext *cx, ptr_t object) {
+    Pair *p = (Pair*) object;
+    found_ptrs(cx, 1, &p->left);
+    found_ptrs(cx, 1, &p->right);
+}
+
+} // namespace client
+} // namespace gc
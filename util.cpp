@@ -4,6 +4,16 @@
 #include <cstdio>
 #include <cstdint>
 #include <cerrno>
+#include <ctime>
+
+extern "C" {
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
 
 namespace util {
 
@@ -25,8 +35,87 @@ void vdie(const char *format, va_list ap) {
 }
 
 size_t page_size() {
-    // TODO: this is wrong
-    return 4096;
+    static size_t size = 0;
+    if (!size) {
+        long n = sysconf(_SC_PAGESIZE);
+        size = n > 0 ? (size_t) n : 4096;
+    }
+    return size;
+}
+
+size_t num_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t) n : 1;
+}
+
+// Read from /sys once, on first use.
+static size_t *packages;
+static size_t npackages;
+static pthread_once_t packages_once = PTHREAD_ONCE_INIT;
+
+static void read_packages() {
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    npackages = n > 0 ? (size_t) n : 1;
+    packages = (size_t*) smalloc(npackages * sizeof(size_t));
+    for (size_t cpu = 0; cpu < npackages; ++cpu) {
+        char path[80];
+        snprintf(path, sizeof path,
+                 "/sys/devices/system/cpu/cpu%zu/topology/physical_package_id",
+                 cpu);
+        int id = -1;
+        if (FILE *f = fopen(path, "r")) {
+            if (fscanf(f, "%d", &id) != 1)
+                id = -1;
+            fclose(f);
+        }
+        packages[cpu] = id >= 0 ? (size_t) id : 0;
+    }
+}
+
+size_t cpu_package(int cpu) {
+    if (pthread_once(&packages_once, read_packages))
+        die("pthread_once failed");
+    return cpu >= 0 && (size_t) cpu < npackages ? packages[cpu] : 0;
+}
+
+size_t current_package() {
+    return cpu_package(sched_getcpu());
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        perror("clock_gettime");
+        die();
+    }
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Errors (the value changed, a signal, the timeout) all just mean return.
+void futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns) {
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ns) {
+        ts.tv_sec = timeout_ns / 1000000000;
+        ts.tv_nsec = timeout_ns % 1000000000;
+        tsp = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+size_t env_size(const char *name, size_t dflt) {
+    const char *s = getenv(name);
+    if (!s || !*s) return dflt;
+
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || *end || *s == '-')
+        die("bad value for %s: '%s'", name, s);
+    return (size_t) v;
 }
 
 void *smalloc(size_t size) {
@@ -63,4 +152,57 @@ void sfree(size_t size, void *p) {
     (void) size;
 }
 
+void *map_pages(size_t size) {
+    assert (ALIGNED(page_size(), size));
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) die("out of memory");
+    return p;
+}
+
+void *map_lazy_pages(size_t size) {
+    assert (ALIGNED(page_size(), size));
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) die("out of memory");
+    return p;
+}
+
+void *map_aligned_pages(size_t alignment, size_t size) {
+    assert (ALIGNED(page_size(), alignment) && !(alignment & (alignment - 1)));
+    // Map enough that an aligned range must fit, then trim the ends.
+    char *p = (char*) map_pages(size + alignment - page_size());
+    char *start = (char*) ALIGN_UP(alignment, (uintptr_t) p);
+    size_t head = start - p;
+    size_t tail = alignment - page_size() - head;
+    if (head) unmap_pages(head, p);
+    if (tail) unmap_pages(tail, start + size);
+    return start;
+}
+
+void unmap_pages(size_t size, void *p) {
+    assert (ALIGNED(page_size(), (uintptr_t) p));
+    if (munmap(p, size)) {
+        perror("munmap");
+        die();
+    }
+}
+
+void guard_pages(size_t size, void *p) {
+    if (mprotect(p, size, PROT_NONE)) {
+        perror("mprotect");
+        die();
+    }
+}
+
+void advise_huge_pages(size_t size, void *p) {
+#ifdef MADV_HUGEPAGE
+    // Only a hint; older kernels may refuse it.
+    (void) madvise(p, size, MADV_HUGEPAGE);
+#else
+    (void) size;
+    (void) p;
+#endif
+}
+
 } // namespace util
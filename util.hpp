@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdarg>
+#include <cstdint>
 
 #ifdef NDEBUG
 #define DEBUG(...)
@@ -23,6 +24,14 @@
 #define MAX(x,y) ((x)>=(y) ? (x) : (y))
 #define MIN(x,y) ((x)<=(y) ? (x) : (y))
 
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __asm__ __volatile__ ("pause" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
 #define ALIGNED(align, v) (!((v) % (align)))
 #define ALIGN_DOWN(align, v) ((v) - ((v) % (align)))
 #define ALIGN_UP(align, v)                                      \
@@ -40,12 +49,46 @@ void die(const char *format, ...);
 void vdie(const char *format, va_list ap);
 
 size_t page_size();
+size_t num_cpus();
+
+// The physical package (socket) that CPU `cpu' belongs to, as numbered in
+// /sys/devices/system/cpu; 0 if we can't tell.
+size_t cpu_package(int cpu);
+// The package of the CPU the calling thread is running on right now.
+size_t current_package();
+
+// Monotonic time in nanoseconds, from some arbitrary starting point.
+uint64_t now_ns();
+
+// Sleeps while *addr is `val', until futex_wake() on `addr' or for at most
+// timeout_ns (0 means no limit). May also return early for no reason.
+void futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns);
+// Wakes up to n threads sleeping in futex_wait() on `addr'.
+void futex_wake(uint32_t *addr, int n);
+
+// Reads a non-negative integer from the environment variable `name', or
+// returns `dflt' if it is unset or empty. Dies if it is malformed.
+size_t env_size(const char *name, size_t dflt);
 
 // Will die() rather than return NULL.
 void *smalloc(size_t size);
 void *smemalign(size_t alignment, size_t size);
 void sfree(size_t size, void *ptr);
 
+// Fresh zeroed pages straight from the OS; `size' must be a multiple of
+// page_size(). Will die() rather than fail.
+void *map_pages(size_t size);
+// Likewise, aligned to `alignment', a power-of-two multiple of page_size().
+void *map_aligned_pages(size_t alignment, size_t size);
+// Likewise, but without reserving swap for them, so that big mappings cost
+// only the pages actually touched.
+void *map_lazy_pages(size_t size);
+void unmap_pages(size_t size, void *ptr);
+// Makes the pages inaccessible, so that touching them crashes.
+void guard_pages(size_t size, void *ptr);
+// Hints that the pages would be better backed by huge pages. May do nothing.
+void advise_huge_pages(size_t size, void *ptr);
+
 } // namespace util
 
 #endif // UTIL_HPP_